@@ -1,28 +1,124 @@
-#include <new>
+#include <set>
+#include <mutex>
+#include <atomic>
 #include <string.h>
 
 #include "block.h"
+#include "bufpool.h"
 
-Block::Block() : data(0), length(0), lastaccessed(-1), dirty(false)
+
+// Copy and allocation counts of one thread, so that threads copying
+// blocks on a cache hit do not all write the same counter
+struct BlockCounts {
+  // only written by the owning thread
+  atomic<SIZE_T> copies;
+  atomic<SIZE_T> allocs;
+
+  BlockCounts();
+  ~BlockCounts();
+};
+
+static mutex              countslock;
+static set<BlockCounts *> counts;
+static SIZE_T             retiredcopies=0;
+static SIZE_T             retiredallocs=0;
+
+static thread_local BlockCounts localcounts;
+// Set once localcounts is gone at thread exit, after which the
+// retired totals are counted directly
+static thread_local bool countsdead=false;
+
+
+BlockCounts::BlockCounts() : copies(0), allocs(0)
+{
+  lock_guard<mutex> g(countslock);
+  counts.insert(this);
+}
+
+BlockCounts::~BlockCounts()
+{
+  countsdead=true;
+
+  lock_guard<mutex> g(countslock);
+  retiredcopies+=copies.load(memory_order_relaxed);
+  retiredallocs+=allocs.load(memory_order_relaxed);
+  counts.erase(this);
+}
+
+static void Count(atomic<SIZE_T> BlockCounts::*c, SIZE_T &retired)
+{
+  if (countsdead) {
+    lock_guard<mutex> g(countslock);
+    retired++;
+    return;
+  }
+  atomic<SIZE_T> &n=localcounts.*c;
+  n.store(n.load(memory_order_relaxed)+1,memory_order_relaxed);
+}
+
+static void CountCopy()
+{
+  Count(&BlockCounts::copies,retiredcopies);
+}
+
+static void CountAlloc()
+{
+  Count(&BlockCounts::allocs,retiredallocs);
+}
+
+static SIZE_T Total(atomic<SIZE_T> BlockCounts::*c, const SIZE_T &retired)
+{
+  lock_guard<mutex> g(countslock);
+  SIZE_T n=retired;
+
+  for (set<BlockCounts *>::const_iterator i=counts.begin();i!=counts.end();++i) {
+    n+=((*i)->*c).load(memory_order_relaxed);
+  }
+  return n;
+}
+
+SIZE_T Block::GetNumCopies()
+{
+  return Total(&BlockCounts::copies,retiredcopies);
+}
+
+SIZE_T Block::GetNumAllocs()
+{
+  return Total(&BlockCounts::allocs,retiredallocs);
+}
+
+
+
+Block::Block() : data(0), length(0), capacity(0), lastaccessed(-1), dirty(false), borrowed(false)
 {}
 
 
-Block::Block(const SIZE_T s) : data(0), length(0), lastaccessed(-1), dirty(false)
+Block::Block(const SIZE_T s) : data(0), length(0), capacity(0), lastaccessed(-1), dirty(false), borrowed(false)
 {
   Resize(s);
 }
 
 
 
-Block::Block(const Block &rhs) : data(0), length(0), lastaccessed(rhs.lastaccessed), dirty(rhs.dirty)
+Block::Block(const Block &rhs) : data(0), length(0), capacity(0), lastaccessed(-1), dirty(false), borrowed(false)
 {
-  if (Resize(rhs.length)!=ERROR_NOERROR) { 
-    throw GenericException();
+  CopyFrom(rhs);
+  CountCopy();
+}
+
+Block::Block(Block &&rhs) noexcept : data(0), length(0), capacity(0), lastaccessed(-1), dirty(false), borrowed(false)
+{
+  if (rhs.OnHeap()) { 
+    Steal(rhs);
+  } else {
+    CopyFrom(rhs);
+    if (rhs.borrowed) { 
+      CountCopy();
+    }
   }
-  memcpy(data,rhs.data,rhs.length);
 }
 
-Block::Block(const char * str) : data(0), length(0), lastaccessed(-1), dirty(false)
+Block::Block(const char * str) : data(0), length(0), capacity(0), lastaccessed(-1), dirty(false), borrowed(false)
 {
   if (Resize(strlen(str))!=ERROR_NOERROR) { 
     throw GenericException();
@@ -32,15 +128,75 @@ Block::Block(const char * str) : data(0), length(0), lastaccessed(-1), dirty(fal
 
 Block::~Block() 
 { 
-  if (data) { delete [] data; data=0; }
-  length=0;
+  if (OnHeap()) { BufferPool::Put(data); }
+  data=0;
+  length=capacity=0;
   lastaccessed=-1;
   dirty=false;
 }
 
 Block & Block::operator=(const Block &rhs)
 {
-  return *(new (this) Block(rhs));
+  if (this==&rhs) { 
+    return *this;
+  }
+  CopyFrom(rhs);
+  CountCopy();
+  return *this;
+}
+
+Block & Block::operator=(Block &&rhs) noexcept
+{
+  if (this==&rhs) { 
+    return *this;
+  }
+  if (!borrowed && rhs.OnHeap()) { 
+    Steal(rhs);
+  } else {
+    CopyFrom(rhs);
+    if (borrowed || rhs.borrowed) { 
+      CountCopy();
+    }
+  }
+  return *this;
+}
+
+
+void Block::CopyFrom(const Block &rhs)
+{
+  if (Resize(rhs.length,false)!=ERROR_NOERROR) { 
+    throw GenericException();
+  }
+  memcpy(data,rhs.data,rhs.length);
+  lastaccessed=rhs.lastaccessed;
+  dirty=rhs.dirty;
+}
+
+// Take the heap buffer of rhs, which is left empty
+void Block::Steal(Block &rhs)
+{
+  if (OnHeap()) { 
+    BufferPool::Put(data);
+  }
+  data=rhs.data;
+  length=rhs.length;
+  capacity=rhs.capacity;
+  lastaccessed=rhs.lastaccessed;
+  dirty=rhs.dirty;
+  borrowed=false;
+  rhs.data=0;
+  rhs.length=rhs.capacity=0;
+}
+
+
+void Block::Borrow(BYTE_T *buf, const SIZE_T len)
+{
+  if (OnHeap()) { 
+    BufferPool::Put(data);
+  }
+  data=buf;
+  length=capacity=len;
+  borrowed=true;
 }
 
 
@@ -50,22 +206,34 @@ Block & Block::operator=(const Block &rhs)
 ERROR_T Block::Resize(const SIZE_T newlen, const bool copy)
 {
   BYTE_T *d;
-  
-  try {
-    d = new BYTE_T [newlen];
+  SIZE_T newcap=newlen;
+
+  if (newlen<=capacity && (data || newlen==0)) { 
+    length=newlen;
+    return ERROR_NOERROR;
   }
-  catch (...) {
-    return ERROR_NOMEM;
+
+  if (newlen<=BLOCK_INLINE_SIZE) { 
+    // only reached from an empty or borrowed buffer
+    d = inlinedata;
+  } else {
+    // rounded up to a pool size class
+    if (!(d = BufferPool::Get(newcap))) {
+      return ERROR_NOMEM;
+    }
+    CountAlloc();
   }
 
-  if (copy) { 
-    memcpy(d,data,MIN(newlen,length));
+  if (copy && data) { 
+    memmove(d,data,MIN(newlen,length));
   }
   
-  if (data) { delete [] data; }
+  if (OnHeap()) { BufferPool::Put(data); }
   data = d;
+  borrowed=false;
 
   length=newlen;
+  capacity = d==inlinedata ? BLOCK_INLINE_SIZE : newcap;
 
   return ERROR_NOERROR;
 }
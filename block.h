@@ -7,19 +7,53 @@
 
 using namespace std;
 
+// Payloads up to this many bytes, such as most keys and values, are
+// kept inside the Block itself instead of on the heap
+#ifndef BLOCK_INLINE_SIZE
+#define BLOCK_INLINE_SIZE 32
+#endif
+
 struct Block {
   BYTE_T	*data;
   SIZE_T 	length;
+  SIZE_T        capacity;      // bytes available at data
   double        lastaccessed;  // for use in buffercache only
   bool          dirty;         // for use in buffercahce only
+  bool          borrowed;      // data belongs to someone else
+  BYTE_T        inlinedata[BLOCK_INLINE_SIZE];
+
+  // Totals over all blocks and threads, for finding copies and
+  // allocations on paths that should not have any.  Each thread
+  // counts its own, and these sum them.
+  static SIZE_T GetNumCopies();
+  static SIZE_T GetNumAllocs();
 
   Block();
   Block(const SIZE_T size);
   Block(const Block &rhs);
+  // Takes the buffer of rhs, leaving it empty, unless rhs borrows
+  // its buffer or keeps its data inline, in which case this copies.
+  // Neither move throws, so that vectors of blocks move them when
+  // they grow; running out of memory while copying a borrowed
+  // buffer ends the program.
+  Block(Block &&rhs) noexcept;
   Block(const char *data);
   virtual ~Block();
+  // Assignment copies into the existing buffer when it is large
+  // enough.  A move takes the buffer of rhs instead, unless either
+  // block borrows its buffer or rhs is inline, in which case it
+  // copies.
   Block & operator=(const Block &rhs);
+  Block & operator=(Block &&rhs) noexcept;
 
+  // Use buf, which stays owned by the caller, as the data.  The
+  // block never frees it, and keeps it until resized beyond len.
+  // The contents of buf are left as they are.
+  void    Borrow(BYTE_T *buf, const SIZE_T len);
+
+  // The buffer is only replaced when it is too small, and lengths
+  // up to BLOCK_INLINE_SIZE never need the heap.  Larger buffers
+  // come from the BufferPool, so capacity may exceed the length.
   // returns one of ERROR_NOERROR (zero)
   // ERROR_NOMEM or other nonzero error code.
   ERROR_T Resize(const SIZE_T newlength, const bool copy=true);
@@ -28,6 +62,11 @@ struct Block {
   bool operator==(const Block &rhs) const;
 
   ostream & Print(ostream &os) const;
+
+ private:
+  bool    OnHeap() const { return data && !borrowed && data!=inlinedata; }
+  void    CopyFrom(const Block &rhs);
+  void    Steal(Block &rhs);
 };
 
 inline ostream & operator<<(ostream &os, const Block &b) { return b.Print(os);}
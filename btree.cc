@@ -23,7 +23,9 @@ KeyValuePair::~KeyValuePair()
 
 KeyValuePair & KeyValuePair::operator=(const KeyValuePair &rhs)
 {
-  return *( new (this) KeyValuePair(rhs));
+  key=rhs.key;
+  value=rhs.value;
+  return *this;
 }
 
 BTreeIndex::BTreeIndex(SIZE_T keysize, 
@@ -198,7 +200,8 @@ ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
   KEY_T testkey;
   SIZE_T ptr;
 
-  rc= b.Unserialize(buffercache,node);
+  // Work on the cached block in place, so a lookup copies no blocks
+  rc= b.Pin(buffercache,node);
 
   if (rc!=ERROR_NOERROR) { 
     return rc;
@@ -218,6 +221,7 @@ ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
   // this one, if it exists
   rc=b.GetPtr(offset,ptr);
   if (rc) { return rc; }
+  b.Unpin();
   return LookupOrUpdateInternal(ptr,op,key,value);
       }
     }
@@ -225,6 +229,7 @@ ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
     if (b.info.numkeys>0) { 
       rc=b.GetPtr(b.info.numkeys,ptr);
       if (rc) { return rc; }
+      b.Unpin();
       return LookupOrUpdateInternal(ptr,op,key,value);
     } else {
       // There are no keys at all on this node, so nowhere to go
@@ -243,10 +248,8 @@ ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
     rc = b.SetVal(offset,value);
     if (rc) { return rc; }
 
-    rc = b.Serialize(buffercache, node);
-    if (rc) { return rc; }
-
-    return ERROR_NOERROR;
+    // The value was changed in the cached block itself
+    return b.Unpin(true);
   }
       }
     }
@@ -401,7 +404,7 @@ ERROR_T BTreeIndex::LookupInsertion(list<SIZE_T> &clues, const SIZE_T &blocknum,
 
   clues.push_front(blocknum);
 
-  rc = node.Unserialize(buffercache, blocknum);
+  rc = node.Pin(buffercache, blocknum);
 
   if (rc != ERROR_NOERROR) {
     return rc;
@@ -417,6 +420,7 @@ ERROR_T BTreeIndex::LookupInsertion(list<SIZE_T> &clues, const SIZE_T &blocknum,
         if (key < tempkey) {
           rc = node.GetPtr(offset, tempptr);
           if (rc) { return rc; }
+          node.Unpin();
   
           return LookupInsertion(clues, tempptr, key);
         }
@@ -426,6 +430,7 @@ ERROR_T BTreeIndex::LookupInsertion(list<SIZE_T> &clues, const SIZE_T &blocknum,
       if (node.info.numkeys > 0) { 
         rc = node.GetPtr(node.info.numkeys, tempptr);
         if (rc) { return rc; }
+        node.Unpin();
   
         return LookupInsertion(clues, tempptr, key);
   
@@ -972,6 +977,17 @@ ERROR_T BTreeIndex::RangeQuery(const KEY_T &minkey, const KEY_T &maxkey,
                                list<VALUE_T> &valuelist)
 {
   ERROR_T rc;
+
+  buffercache->BeginScan();
+  rc = RangeQueryInternal(minkey, maxkey, valuelist);
+  buffercache->EndScan();
+  return rc;
+}
+
+ERROR_T BTreeIndex::RangeQueryInternal(const KEY_T &minkey, const KEY_T &maxkey,
+                                       list<VALUE_T> &valuelist)
+{
+  ERROR_T rc;
   BTreeNode leaf;
 
   KEY_T tempkey;
@@ -987,9 +1003,17 @@ ERROR_T BTreeIndex::RangeQuery(const KEY_T &minkey, const KEY_T &maxkey,
   leafptr = clues.front();
 
   while (keylist.empty() || keylist.back() < maxkey) {
-    rc = leaf.Unserialize(buffercache, leafptr);
+    rc = leaf.Pin(buffercache, leafptr);
     if (rc) { return rc; }
 
+    // Start reading the next leaf while we scan this one
+    if (leaf.info.nodetype == BTREE_LEAF_NODE) {
+      SIZE_T nextptr;
+      if (leaf.GetPtr(0, nextptr) == ERROR_NOERROR && nextptr != 0) {
+        buffercache->PrefetchBlock(nextptr);
+      }
+    }
+
     for (SIZE_T i = 0; i < leaf.info.numkeys; i++) {
       rc = leaf.GetKey(i, tempkey);
       if (rc) { return rc; }
@@ -1030,6 +1054,26 @@ ERROR_T BTreeIndex::Delete(const KEY_T &key)
   return ERROR_UNIMPL;
 }
 
+
+//
+// Ask the cache to start reading all of an interior node's children,
+// so that their seeks overlap with the traversal.  The cache refuses
+// once it has no room, so this never displaces much.
+//
+void BTreeIndex::PrefetchChildren(const BTreeNode &b) const
+{
+  SIZE_T ptr;
+
+  for (SIZE_T offset=0; offset<=b.info.numkeys; offset++) {
+    if (b.GetPtr(offset,ptr)!=ERROR_NOERROR) {
+      return;
+    }
+    if (buffercache->PrefetchBlock(ptr)==ERROR_NOFETCH) {
+      return;
+    }
+  }
+}
+
   
 //
 //
@@ -1047,7 +1091,7 @@ ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
   ERROR_T rc;
   SIZE_T offset;
 
-  rc= b.Unserialize(buffercache,node);
+  rc= b.Pin(buffercache,node);
 
   if (rc!=ERROR_NOERROR) { 
     return rc;
@@ -1069,6 +1113,7 @@ ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
   case BTREE_ROOT_NODE:
   case BTREE_INTERIOR_NODE:
     if (b.info.numkeys>0) { 
+      PrefetchChildren(b);
       for (offset=0;offset<=b.info.numkeys;offset++) { 
   rc=b.GetPtr(offset,ptr);
   if (rc) { return rc; }
@@ -1102,7 +1147,9 @@ ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const
   if (display_type==BTREE_DEPTH_DOT) { 
     o << "digraph tree { \n";
   }
+  buffercache->BeginScan();
   rc=DisplayInternal(superblock.info.rootnode,o,display_type);
+  buffercache->EndScan();
   if (display_type==BTREE_DEPTH_DOT) { 
     o << "}\n";
   }
@@ -1117,7 +1164,9 @@ ERROR_T BTreeIndex::SanityCheck() const
   ERROR_T rc;
   SIZE_T tempnode = superblock.info.rootnode;
 
+  buffercache->BeginScan();
   rc = Check(checked, leafkeys, tempnode);
+  buffercache->EndScan();
   return rc;
 }  
 
@@ -1139,11 +1188,12 @@ ERROR_T BTreeIndex::Check(set<SIZE_T> &checked, list<KEY_T> &leafkeys, SIZE_T &n
   }
 
 
-  rc = b.Unserialize(buffercache, node);
+  rc = b.Pin(buffercache, node);
   if(rc) {return rc;}
 
   switch(b.info.nodetype){
     case BTREE_ROOT_NODE: {
+      PrefetchChildren(b);
       for(offset=0; offset<=b.info.numkeys; offset++){
         rc = b.GetPtr(offset, ptr);
         if(rc) {return rc;}
@@ -1158,6 +1208,7 @@ ERROR_T BTreeIndex::Check(set<SIZE_T> &checked, list<KEY_T> &leafkeys, SIZE_T &n
         return ERROR_NODEOVERFLOW;
       }
     
+      PrefetchChildren(b);
       for(offset=0; offset<=b.info.numkeys; offset++){
         rc = b.GetPtr(offset, ptr);
         if(rc) {return rc;}
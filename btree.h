@@ -61,9 +61,15 @@ class BTreeIndex {
 				      VALUE_T &val);
   
 
+  void         PrefetchChildren(const BTreeNode &node) const;
+
   ERROR_T      DisplayInternal(const SIZE_T &node,
 			       ostream &o, 
 			       const BTreeDisplayType display_type=BTREE_DEPTH) const;
+
+  ERROR_T      RangeQueryInternal(const KEY_T &minkey, 
+				  const KEY_T &maxkey, 
+				  list<VALUE_T> &valuelist);
 public:
   //
   // keysize and valueszie should be stored in the 
@@ -125,6 +131,8 @@ public:
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
   ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
+  // RangeQuery, SanityCheck and Display read the blocks they visit
+  // as a scan, so they do not push the working set out of the cache
   ERROR_T RangeQuery(const KEY_T &minkey, const KEY_T &maxkey, list<VALUE_T> &valuelist);
 
   // Here you should figure out if your index makes sense
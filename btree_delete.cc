@@ -1,9 +1,10 @@
 #include <stdlib.h>
+#include <unistd.h>
 #include "btree.h"
 
 void usage() 
 {
-  cerr << "usage: btree_delete filestem cachesize key\n";
+  cerr << "usage: btree_delete [-w] filestem cachesize key\n";
 }
 
 
@@ -14,6 +15,20 @@ int main(int argc, char **argv)
   SIZE_T superblocknum;
   char *key;
 
+  bool warm=false;
+  int opt;
+
+  while ((opt=getopt(argc,argv,"+w"))!=-1) {
+    if (opt!='w') {
+      usage();
+      return -1;
+    }
+    warm=true;
+  }
+  // the rest as if there had been no options
+  argc-=optind-1;
+  argv+=optind-1;
+
   if (argc!=4) { 
     usage();
     return -1;
@@ -30,10 +45,17 @@ int main(int argc, char **argv)
   ERROR_T rc;
 
 
+  if (warm) {
+    // reload what the last run left in the cache, and save it again
+    cache.SetManifest(string(filestem)+".manifest");
+  }
   if ((rc=cache.Attach())!=ERROR_NOERROR) { 
     cerr << "Can't attach buffer cache due to error"<<rc<<endl;
     return -1;
   }
+  // simulated time from opening the tree to the end of the
+  // operation, which is where a cold cache hurts
+  double opstart=cache.GetCurrentTime();
 
   if ((rc=btree.Attach(0))!=ERROR_NOERROR) { 
     cerr << "Can't attach to index  due to error "<<rc<<endl;
@@ -45,6 +67,7 @@ int main(int argc, char **argv)
     } else {
       cerr <<"Delete succeeded\n";
     }
+    double optime=cache.GetCurrentTime()-opstart;
     if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) { 
       cerr <<"Can't detach from index due to error "<<rc<<endl;
       return -1;
@@ -61,6 +84,9 @@ int main(int argc, char **argv)
     cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
     cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
     cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+    cerr << "warmblocks      = "<<cache.GetNumWarmBlocks()<<endl;
+    cerr << "warmuptime      = "<<cache.GetWarmupTime()<<endl;
+    cerr << "op time         = "<<optime<<endl;
     cerr << endl;
     
     cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
@@ -5,6 +5,7 @@
 
 #include "btree_ds.h"
 #include "buffercache.h"
+#include "bufpool.h"
 
 #include "btree.h"
 
@@ -44,14 +45,16 @@ BTreeNode::BTreeNode()
 {
   info.nodetype=BTREE_UNALLOCATED_BLOCK; 
   data=0;
+  pincache=0;
+  pinblock=0;
 }
 
 BTreeNode::~BTreeNode()
 {
-  if (data) { 
-    delete [] data;
+  if (pincache) { 
+    Unpin();
   }
-  data=0;
+  FreeData();
   info.nodetype=BTREE_UNALLOCATED_BLOCK;
 }
 
@@ -66,8 +69,10 @@ BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T b
   info.freelist=0;
   info.numkeys=0;				       
   data=0;
+  pincache=0;
+  pinblock=0;
   if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
-    data = new char [info.GetNumDataBytes()];
+    NewData();
     memset(data,0,info.GetNumDataBytes());
   }
 }
@@ -82,19 +87,63 @@ BTreeNode::BTreeNode(const BTreeNode &rhs)
   info.freelist=rhs.info.freelist;
   info.numkeys=rhs.info.numkeys;				       
   data=0;
+  pincache=0;
+  pinblock=0;
   if (rhs.data) { 
-   data=new char [info.GetNumDataBytes()];
+    NewData();
     memcpy(data,rhs.data,info.GetNumDataBytes());
   }
 }
 
 
+void BTreeNode::NewData()
+{
+  SIZE_T size=info.GetNumDataBytes();
+
+  if (!(data=(char *)BufferPool::Get(size))) { 
+    throw GenericException();
+  }
+}
+
+void BTreeNode::FreeData()
+{
+  BufferPool::Put((BYTE_T *)data);
+  data=0;
+}
+
+
 BTreeNode & BTreeNode::operator=(const BTreeNode &rhs) 
 {
+  if (this==&rhs) { 
+    return *this;
+  }
+  if (pincache) { 
+    Unpin();
+  }
+  FreeData();
   return *(new (this) BTreeNode(rhs));
 }
 
 
+//
+// What the cache is told about a node of this type.  Free blocks
+// compete with the leaves.
+//
+static AccessHint NodeHint(const int nodetype)
+{
+  switch (nodetype) { 
+  case BTREE_SUPERBLOCK:
+    return HINT_SUPERBLOCK;
+  case BTREE_ROOT_NODE:
+    return HINT_ROOT;
+  case BTREE_INTERIOR_NODE:
+    return HINT_INTERIOR;
+  default:
+    return HINT_LEAF;
+  }
+}
+
+
 ERROR_T BTreeNode::Serialize(BufferCache *b, const SIZE_T blocknum) const
 {
   assert((unsigned)info.blocksize==b->GetBlockSize());
@@ -106,40 +155,101 @@ ERROR_T BTreeNode::Serialize(BufferCache *b, const SIZE_T blocknum) const
     memcpy(block.data+sizeof(info),data,info.GetNumDataBytes());
   }
 
-  return b->WriteBlock(blocknum,block);
+  return b->WriteBlock(blocknum,block,NodeHint(info.nodetype));
 } // write to disk
 
 
 ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum)
 {
-  Block block;
+  // the bytes are copied into data, so the cache's are enough
+  BlockRef block;
 
   ERROR_T rc;
 
+  if (pincache) { 
+    Unpin();
+  }
+
   rc=b->ReadBlock(blocknum,block);
 
   if (rc!=ERROR_NOERROR) {
     return rc;
   }
 
-  memcpy(&info,block.data,sizeof(info));
+  memcpy(&info,block->data,sizeof(info));
+
+  // the type is only known now that the block has been read
+  b->SetBlockHint(blocknum,NodeHint(info.nodetype));
   
-  if (data) { 
-    delete [] data;
-    data=0;
-  }
+  FreeData();
 
   assert(b->GetBlockSize()==(unsigned)info.blocksize);
 
   if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
-    data = new char [info.GetNumDataBytes()];
-    memcpy(data,block.data+sizeof(info),info.GetNumDataBytes());
+    NewData();
+    memcpy(data,block->data+sizeof(info),info.GetNumDataBytes());
   }
   
   return ERROR_NOERROR;
 }
 
 
+ERROR_T BTreeNode::Pin(BufferCache *b, const SIZE_T blocknum)
+{
+  Block *block;
+  ERROR_T rc;
+
+  if (pincache) { 
+    Unpin();
+  }
+  FreeData();
+
+  rc=b->PinBlock(blocknum,block);
+
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+
+  memcpy(&info,block->data,sizeof(info));
+
+  assert(b->GetBlockSize()==(unsigned)info.blocksize);
+
+  b->SetBlockHint(blocknum,NodeHint(info.nodetype));
+
+  pincache=b;
+  pinblocknum=blocknum;
+  pinblock=block;
+
+  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
+    data = (char *) block->data+sizeof(info);
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::Unpin(const bool dirty)
+{
+  ERROR_T rc;
+
+  if (!pincache) { 
+    return ERROR_NOERROR;
+  }
+
+  if (dirty) { 
+    memcpy(pinblock->data,&info,sizeof(info));
+  }
+
+  rc=pincache->UnpinBlock(pinblocknum,dirty);
+
+  pincache=0;
+  pinblock=0;
+  data=0;
+
+  return rc;
+}
+
+
 char * BTreeNode::ResolveKey(const SIZE_T offset) const
 {
   switch (info.nodetype) { 
@@ -66,6 +66,12 @@ struct BTreeNode {
   // interior => array of keys
   // leaf => array of key/value pairs
 
+  // Set while the node is pinned.  data then points into the
+  // cached block instead of at a private copy.
+  BufferCache  *pincache;
+  SIZE_T        pinblocknum;
+  Block        *pinblock;
+
 
   BTreeNode();
   //
@@ -81,6 +87,13 @@ struct BTreeNode {
   ERROR_T Serialize(BufferCache *b, const SIZE_T block) const;
   ERROR_T Unserialize(BufferCache *b, const SIZE_T block);
 
+  // Work on the block in place in the cache instead of on a copy.
+  // Set* calls on a pinned node change the cached block directly.
+  // Unpin(true) writes info back into the block and marks it dirty.
+  // A node still pinned when it is destroyed is unpinned clean.
+  ERROR_T Pin(BufferCache *b, const SIZE_T block);
+  ERROR_T Unpin(const bool dirty=false);
+
   char *ResolveKey(const SIZE_T offset) const; // Gives a pointer to the ith key  (interior or leaf)
   char *ResolvePtr(const SIZE_T offset) const; // Gives a pointer to the ith pointer (interior)
   char *ResolveVal(const SIZE_T offset) const; // Gives a pointer to the ith value (leaf)
@@ -98,6 +111,11 @@ struct BTreeNode {
   ERROR_T SetKeyVal(const SIZE_T offset, const KeyValuePair &p); // Writes the ith key value pair (leaf)
 
   ostream &Print(ostream &rhs) const;
+
+ private:
+  // data of an unpinned node comes from the BufferPool
+  void NewData();
+  void FreeData();
 };
 
 
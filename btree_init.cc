@@ -40,6 +40,8 @@ int main(int argc, char **argv)
     return -1;
   } else {
     cerr << "Index created!"<<endl;
+    // a manifest left by btree_* -w or sim -w names blocks of the old tree
+    remove((string(filestem)+".manifest").c_str());
     if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) { 
       cerr <<"Can't detach from index due to error "<<rc<<endl;
       return -1;
@@ -0,0 +1,163 @@
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "btree.h"
+#include "bufpool.h"
+
+
+void usage()
+{
+  cerr << "usage: btreebench [-c] filestem cachesize numkeys numlookups [keysize valuesize]\n";
+  cerr << "       -c fails if a lookup allocates more than its budget\n";
+}
+
+static double walltime()
+{
+  struct timeval tv;
+  gettimeofday(&tv,0);
+  return tv.tv_sec*1e6 + tv.tv_usec;
+}
+
+// Fixed width decimal strings, like those of gen_test_sequence.pl
+static string RandomString(const SIZE_T width, unsigned &seed)
+{
+  string s(width,'0');
+
+  for (SIZE_T i=0;i<width;i++) {
+    s[i]='0'+rand_r(&seed)%10;
+  }
+  return s;
+}
+
+
+//
+// Measures the CPU cost of Insert and Lookup.  A fresh tree is built
+// from numkeys random keys, and then numlookups random keys from it
+// are looked up.  Each operation makes its key from a string, as sim
+// does.  The cache should hold the whole tree, so that the times are
+// those of the index and not of the disk.
+//
+// With -c, the lookups must not allocate more than one Block for
+// each node they visit, the scratch key a node is searched with,
+// plus two for the key and value each one makes.  Allocating for
+// each key compared, rather than for each node, goes over that
+// budget once the keys are too large to be kept inline.
+//
+int main(int argc, char *argv[])
+{
+  bool check=false;
+  int opt;
+
+  while ((opt=getopt(argc,argv,"c"))!=-1) {
+    switch (opt) {
+    case 'c':
+      check=true;
+      break;
+    default:
+      usage();
+      return -1;
+    }
+  }
+  argc-=optind-1;
+  argv+=optind-1;
+
+  if (argc!=5 && argc!=7) {
+    usage();
+    return -1;
+  }
+
+  SIZE_T cachesize=atoi(argv[2]);
+  SIZE_T numkeys=atoi(argv[3]);
+  SIZE_T numlookups=atoi(argv[4]);
+  SIZE_T keysize = argc==7 ? atoi(argv[5]) : 8;
+  SIZE_T valuesize = argc==7 ? atoi(argv[6]) : 8;
+  unsigned seed=1;
+
+  DiskSystem disk(argv[1]);
+  BufferCache cache(&disk,cachesize);
+  BTreeIndex btree(keysize,valuesize,&cache);
+  vector<string> keys;
+  string value=RandomString(valuesize,seed);
+  SIZE_T superblocknum;
+  ERROR_T rc;
+
+  for (SIZE_T i=0;i<numkeys;i++) {
+    keys.push_back(RandomString(keysize,seed));
+  }
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) {
+    cerr << "Can't attach buffer cache due to error "<<rc<<endl;
+    return -1;
+  }
+  if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) {
+    cerr << "Can't attach to index due to error "<<rc<<endl;
+    return -1;
+  }
+
+  cerr << "op\tops\tops/s\tallocs/op\tcopies/op\tpoolmisses/op\n";
+
+  SIZE_T allocs=Block::GetNumAllocs();
+  SIZE_T copies=Block::GetNumCopies();
+  SIZE_T misses=BufferPool::GetNumMisses();
+  double start=walltime();
+
+  for (SIZE_T i=0;i<numkeys;i++) {
+    // duplicates just fail
+    btree.Insert(KEY_T(keys[i].c_str()),VALUE_T(value.c_str()));
+  }
+
+  double elapsed=walltime()-start;
+
+  cerr << "insert\t" << numkeys << "\t"
+       << numkeys/(elapsed/1e6) << "\t"
+       << (double)(Block::GetNumAllocs()-allocs)/numkeys << "\t"
+       << (double)(Block::GetNumCopies()-copies)/numkeys << "\t"
+       << (double)(BufferPool::GetNumMisses()-misses)/numkeys << endl;
+
+  allocs=Block::GetNumAllocs();
+  copies=Block::GetNumCopies();
+  misses=BufferPool::GetNumMisses();
+  SIZE_T visits=cache.GetNumReads();
+  start=walltime();
+
+  for (SIZE_T i=0;i<numlookups;i++) {
+    VALUE_T found;
+    if ((rc=btree.Lookup(KEY_T(keys[rand_r(&seed)%numkeys].c_str()),found))!=ERROR_NOERROR) {
+      cerr << "Can't lookup due to error "<<rc<<endl;
+      return -1;
+    }
+  }
+
+  elapsed=walltime()-start;
+
+  cerr << "lookup\t" << numlookups << "\t"
+       << numlookups/(elapsed/1e6) << "\t"
+       << (double)(Block::GetNumAllocs()-allocs)/numlookups << "\t"
+       << (double)(Block::GetNumCopies()-copies)/numlookups << "\t"
+       << (double)(BufferPool::GetNumMisses()-misses)/numlookups << endl;
+
+  if (check) {
+    SIZE_T made=Block::GetNumAllocs()-allocs;
+    SIZE_T budget=cache.GetNumReads()-visits+2*numlookups;
+
+    if (made>budget) {
+      cerr << "Lookups made "<<made<<" allocations, over the budget of "<<budget<<endl;
+      return -1;
+    }
+    cerr << "Lookups made "<<made<<" allocations, within the budget of "<<budget<<endl;
+  }
+
+  if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+    cerr << "Can't detach from index due to error "<<rc<<endl;
+    return -1;
+  }
+  if ((rc=cache.Detach())!=ERROR_NOERROR) {
+    cerr << "Can't detach from buffer cache due to error "<<rc<<endl;
+    return -1;
+  }
+  return 0;
+}
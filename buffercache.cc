@@ -1,258 +1,2416 @@
+#include <vector>
+#include <algorithm>
+#include <unordered_set>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
 #include "buffercache.h"
 
-ERROR_T BufferCache::CheckDeleteOldest()
+typedef unordered_map<SIZE_T, BufferFrame, cache_hash> BlockTable;
+
+// Depth of BeginScan calls on this thread
+static thread_local SIZE_T scandepth=0;
+
+static bool Scanning()
+{
+  return scandepth>0;
+}
+
+// CPU time of the calling thread, in seconds
+static double CPUTime()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID,&ts);
+  return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+
+//
+// Holds a lock for the life of a scope
+//
+class CacheGuard {
+ private:
+  pthread_mutex_t *m;
+ public:
+  CacheGuard(pthread_mutex_t *mutex) : m(mutex) { pthread_mutex_lock(m); }
+  ~CacheGuard() { pthread_mutex_unlock(m); }
+};
+
+
+SIZE_T BufferCache::ShardIndex(const SIZE_T blocknum) const
+{
+  return (blocknum/SHARD_STRIPE)%shards.size();
+}
+
+CacheShard &BufferCache::ShardOf(const SIZE_T blocknum) const
+{
+  return *(shards[ShardIndex(blocknum)]);
+}
+
+
+//
+// A synchronous disk request starts when the disk is free and the
+// caller waits for it to finish
+//
+void BufferCache::ChargeDisk(const double reqtime)
+{
+  double now   = curtime;
+  double start = now>diskfree ? now : diskfree;
+
+  curtime=diskfree=start+reqtime;
+}
+
+//
+// An asynchronous disk request is queued behind outstanding work.
+// Returns the time at which it will complete.
+//
+double BufferCache::ScheduleDisk(const double reqtime)
+{
+  double now   = curtime;
+  double start = now>diskfree ? now : diskfree;
+
+  diskfree=start+reqtime;
+  return diskfree;
+}
+
+//
+// Wait for an asynchronous request that completes at readyat
+//
+void BufferCache::WaitUntil(const double readyat)
+{
+  CacheGuard d(&disklock);
+
+  if (readyat>curtime) {
+    curtime=readyat;
+  }
+}
+
+//
+// Wait for the real read under a prefetched frame, if it is still
+// in flight.  Its simulated time is waited for through readyat.
+//
+ERROR_T BufferCache::Settle(CacheShard &s, BufferFrame &f)
+{
+  ERROR_T rc;
+
+  if (!f.ioticket) { 
+    return ERROR_NOERROR;
+  }
+  {
+    CacheGuard d(&disklock);
+    rc=disk->Wait(f.ioticket);
+  }
+  f.ioticket=0;
+  return rc;
+}
+
+//
+// Feed a demand access to the miss ratio curve.  The curve has its
+// own lock, taken inside the shard lock.
+//
+void BufferCache::RecordAccess(const SIZE_T blocknum)
+{
+  if (mrc) { 
+    CacheGuard m(&mrclock);
+    mrc->Access(blocknum);
+  }
+}
+
+void BufferCache::CountBlock(const SIZE_T blocknum, SIZE_T BlockStats::*counter)
+{
+  if (blocknum<blockstats.size()) { 
+    blockstats[blocknum].*counter+=1;
+  }
+}
+
+
+void BufferCache::SetBlockStats(const bool enable)
+{
+  blockstats.clear();
+  if (enable) { 
+    blockstats.resize(GetNumBlocks());
+  }
+}
+
+
+ERROR_T BufferCache::GetBlockStats(const SIZE_T blocknum, BlockStats &stats) const
+{
+  if (blocknum>=blockstats.size()) { 
+    return ERROR_NOSUCHBLOCK;
+  }
+  CacheShard &s=ShardOf(blocknum);
+  CacheGuard g(&(s.lock));
+
+  stats=blockstats[blocknum];
+  return ERROR_NOERROR;
+}
+
+
+
+//
+// Orders frames for an elevator sweep (C-SCAN): tracks at or beyond
+// the head first, in increasing order, then wrapping around to the
+// lowest track.  Within a track blocks stay in address order, so
+// consecutive blocks remain adjacent.
+//
+class ElevatorOrder {
+ private:
+  const DiskSystem *disk;
+  SIZE_T headtrack;
+ public:
+  ElevatorOrder(const DiskSystem *d) : disk(d), headtrack(d->GetHeadTrack()) {}
+  bool operator()(const SIZE_T a, const SIZE_T b) const {
+    bool awrap = disk->GetTrack(a)<headtrack;
+    bool bwrap = disk->GetTrack(b)<headtrack;
+    if (awrap!=bwrap) { 
+      return bwrap;
+    }
+    return a<b;
+  }
+  bool operator()(const BufferFrame *a, const BufferFrame *b) const {
+    return (*this)(a->blocknum,b->blocknum);
+  }
+};
+
+
+//
+// Write back dirty resident frames.  They go out in elevator order,
+// and each run of consecutive blocks is a single disk request.  The
+// caller holds the locks of the shards the frames belong to.
+//
+ERROR_T BufferCache::WriteBack(vector<BufferFrame *> &frames, const bool background)
+{
+  {
+    CacheGuard d(&disklock);
+    sort(frames.begin(),frames.end(),ElevatorOrder(disk));
+  }
+
+  // Each run is submitted as it is found and they are waited for
+  // together, so that the storage can have several in flight
+  vector<SIZE_T> tickets, starts, nums;
+  ERROR_T result=ERROR_NOERROR;
+  SIZE_T i=0;
+
+  while (i<frames.size()) {
+    SIZE_T num=1;
+    while (i+num<frames.size() &&
+	   num<WRITEBACK_MAX_RUN &&
+	   frames[i+num]->blocknum==frames[i]->blocknum+num) {
+      num++;
+    }
+
+    vector<Block> run;
+    run.reserve(num);
+    for (SIZE_T j=0;j<num;j++) { 
+      run.push_back(frames[i+j]->block);
+    }
+
+    CacheShard &s=ShardOf(frames[i]->blocknum);
+    double reqtime;
+    SIZE_T ticket;
+    int rc;
+    {
+      CacheGuard d(&disklock);
+      rc=disk->SubmitWrite(frames[i]->blocknum,
+			   num,
+			   run,
+			   reqtime,
+			   ticket);
+      if (background) {
+	ScheduleDisk(reqtime);
+      } else {
+	ChargeDisk(reqtime);
+      }
+    }
+    if (background) { 
+      s.flushes++;
+      s.flushedblocks+=num;
+      s.flushtime+=reqtime;
+    }
+    s.diskwrites++;
+    if (rc!=ERROR_NOERROR) { 
+      result=rc;
+      break;
+    }
+    tickets.push_back(ticket);
+    starts.push_back(i);
+    nums.push_back(num);
+    i+=num;
+  }
+
+  for (SIZE_T r=0;r<tickets.size();r++) { 
+    ERROR_T rc;
+    {
+      CacheGuard d(&disklock);
+      rc=disk->Wait(tickets[r]);
+    }
+    if (rc!=ERROR_NOERROR) { 
+      result=rc;
+      continue;
+    }
+    for (SIZE_T j=0;j<nums[r];j++) { 
+      SetDirty(*(frames[starts[r]+j]),false);
+    }
+  }
+  return result;
+}
+
+
+void BufferCache::SetDirty(BufferFrame &f, const bool dirty)
+{
+  CacheShard &s=ShardOf(f.blocknum);
+
+  if (dirty && !f.block.dirty) { 
+    s.numdirty++;
+  } else if (!dirty && f.block.dirty) { 
+    s.numdirty--;
+  }
+  if (dirty) { 
+    f.dirtystamp=++s.dirtyclock;
+  }
+  f.block.dirty=dirty;
+}
+
+
+bool BufferCache::OverHighWater(const CacheShard &s) const
+{
+  return s.highwater>0 && s.numdirty>s.highwater*s.cachesize;
+}
+
+
+//
+// Write back dirty unpinned blocks of a shard, starting from the
+// disk head, until at most the low watermark is dirty
+//
+void BufferCache::FlushCandidates(CacheShard &s, vector<BufferFrame *> &dirtyframes)
+{
+  SIZE_T target=(SIZE_T)(s.lowwater*s.cachesize);
+
+  if (s.numdirty<=target) { 
+    return;
+  }
+
+  for (BlockTable::iterator i=s.blockmap.begin();
+       i!=s.blockmap.end();
+       ++i) {
+    if ((*i).second.block.dirty && (*i).second.pincount==0) { 
+      dirtyframes.push_back(&((*i).second));
+    }
+  }
+  {
+    CacheGuard d(&disklock);
+    sort(dirtyframes.begin(),dirtyframes.end(),ElevatorOrder(disk));
+  }
+  if (dirtyframes.size()>s.numdirty-target) {
+    dirtyframes.resize(s.numdirty-target);
+  }
+}
+
+ERROR_T BufferCache::Flush(CacheShard &s)
+{
+  vector<BufferFrame *> dirtyframes;
+
+  FlushCandidates(s,dirtyframes);
+  return WriteBack(dirtyframes,true);
+}
+
+//
+// Flush for the flusher thread, which holds no lock on entry.  The
+// blocks are copied under the shard lock, and the disk lock is taken
+// before the shard lock is let go.  Any other write of the same
+// blocks, by an eviction or FlushBlock, therefore goes out after
+// these.  Hits on the shard go on while the copies are written.
+// Afterwards a frame is only marked clean if it was not written
+// again in the meantime.
+//
+ERROR_T BufferCache::BackgroundFlush(CacheShard &s)
+{
+  vector<vector<Block> > runs;
+  vector<SIZE_T> starts, stamps, tickets;
+  vector<ERROR_T> results;
+  vector<double> reqtimes;
+  ERROR_T result=ERROR_NOERROR;
+
+  pthread_mutex_lock(&(s.lock));
+  if (OverHighWater(s)) { 
+    vector<BufferFrame *> dirtyframes;
+
+    FlushCandidates(s,dirtyframes);
+    for (SIZE_T i=0;i<dirtyframes.size();i++) { 
+      BufferFrame *f=dirtyframes[i];
+      if (runs.empty() || runs.back().size()>=WRITEBACK_MAX_RUN ||
+	  f->blocknum!=starts.back()+runs.back().size()) { 
+	runs.push_back(vector<Block>());
+	starts.push_back(f->blocknum);
+      }
+      runs.back().push_back(f->block);
+      stamps.push_back(f->dirtystamp);
+    }
+  }
+  if (runs.empty()) { 
+    pthread_mutex_unlock(&(s.lock));
+    return ERROR_NOERROR;
+  }
+  pthread_mutex_lock(&disklock);
+  pthread_mutex_unlock(&(s.lock));
+
+  // all the runs are submitted, then waited for together
+  results.assign(runs.size(),ERROR_NOERROR);
+  tickets.assign(runs.size(),0);
+  reqtimes.assign(runs.size(),0);
+  for (SIZE_T r=0;r<runs.size();r++) { 
+    results[r]=disk->SubmitWrite(starts[r],runs[r].size(),runs[r],reqtimes[r],tickets[r]);
+    ScheduleDisk(reqtimes[r]);
+  }
+  for (SIZE_T r=0;r<runs.size();r++) { 
+    if (results[r]==ERROR_NOERROR) { 
+      results[r]=disk->Wait(tickets[r]);
+    }
+  }
+  pthread_mutex_unlock(&disklock);
+
+  CacheGuard g(&(s.lock));
+  SIZE_T k=0;
+
+  for (SIZE_T r=0;r<runs.size();r++) { 
+    s.flushes++;
+    s.flushedblocks+=runs[r].size();
+    s.flushtime+=reqtimes[r];
+    s.diskwrites++;
+    if (results[r]!=ERROR_NOERROR) { 
+      s.flusherrors++;
+      result=results[r];
+      k+=runs[r].size();
+      continue;
+    }
+    for (SIZE_T j=0;j<runs[r].size();j++,k++) { 
+      BlockTable::iterator b=s.blockmap.find(starts[r]+j);
+      if (b!=s.blockmap.end() && (*b).second.dirtystamp==stamps[k]) { 
+	SetDirty((*b).second,false);
+      }
+    }
+  }
+  return result;
+}
+
+
+ERROR_T BufferCache::MaybeFlush(CacheShard &s)
+{
+  if (!OverHighWater(s)) { 
+    return ERROR_NOERROR;
+  }
+  {
+    CacheGuard f(&flushlock);
+    if (flusherrunning) {
+      flushpending=true;
+      pthread_cond_signal(&flushwake);
+      return ERROR_NOERROR;
+    }
+  }
+  return Flush(s);
+}
+
+
+void *BufferCache::FlusherMain(void *arg)
+{
+  BufferCache *cache=(BufferCache *)arg;
+
+  pthread_mutex_lock(&(cache->flushlock));
+  while (!cache->flusherstop) { 
+    pthread_mutex_unlock(&(cache->flushlock));
+    for (SIZE_T i=0;i<cache->shards.size();i++) {
+      ERROR_T rc=cache->BackgroundFlush(*(cache->shards[i]));
+      if (rc!=ERROR_NOERROR) {
+	// the blocks stay dirty, to be tried again or evicted
+	cerr << "BufferCache: background flush failed with error "<<rc<<endl;
+      }
+    }
+    pthread_mutex_lock(&(cache->flushlock));
+    // woken by MaybeFlush or StopFlusher
+    if (!cache->flusherstop && !cache->flushpending) {
+      pthread_cond_wait(&(cache->flushwake),&(cache->flushlock));
+    }
+    cache->flushpending=false;
+  }
+  pthread_mutex_unlock(&(cache->flushlock));
+  return 0;
+}
+
+
+ERROR_T BufferCache::MakeRoom(CacheShard &s, const SIZE_T room)
+{
+  // Only evict until there is room for that many more blocks.  If
+  // every frame is pinned there is no victim, and the shard runs
+  // over size until some are unpinned.
+  // A scan also keeps to its share of the shard.
+  while (s.blockmap.size()+room > s.cachesize ||
+	 (Scanning() && s.probation.size>=s.probationsize)) {
+    BufferFrame *victim;
+
+    if (s.blockmap.size()+room <= s.cachesize) { 
+      victim=s.probation.OldestEvictable();
+    } else {
+      // With the flusher on, dirty blocks are left for it
+      victim = s.highwater>0 ? ChooseVictim(s,true) : 0;
+      if (!victim) { 
+	victim=ChooseVictim(s,false);
+      }
+    }
+    if (!victim) { 
+      break;
+    }
+
+    // write and delete it, cleaning the dirty unpinned
+    // blocks next to it in the same request
+    if (victim->block.dirty) {
+      vector<BufferFrame *> run;
+      BlockTable::iterator n;
+      SIZE_T lo=victim->blocknum;
+      SIZE_T hi=victim->blocknum;
+
+      while (lo>0 && hi-lo+1<WRITEBACK_MAX_RUN &&
+	     (n=s.blockmap.find(lo-1))!=s.blockmap.end() &&
+	     (*n).second.block.dirty && (*n).second.pincount==0) { 
+	lo--;
+      }
+      while (hi-lo+1<WRITEBACK_MAX_RUN &&
+	     (n=s.blockmap.find(hi+1))!=s.blockmap.end() &&
+	     (*n).second.block.dirty && (*n).second.pincount==0) { 
+	hi++;
+      }
+      for (SIZE_T b=lo;b<=hi;b++) { 
+	run.push_back(&(s.blockmap[b]));
+      }
+      int rc=WriteBack(run);
+      if (rc!=ERROR_NOERROR) { 
+	return rc;
+      }
+    }
+    if (victim->prefetched) { 
+      s.prefetchwaste++;
+      s.numprefetched--;
+    }
+    if (victim->readahead) { 
+      ShrinkReadAhead(s);
+    }
+    Stash(s,*victim);
+    Forget(s,*victim,true);
+    FreeFrame(s,victim->blocknum);
+  }
+  return ERROR_NOERROR;
+}
+
+BufferCache::BufferCache(DiskSystem *d,
+			 SIZE_T cs,
+			 const ReplacementPolicyType pt,
+			 const SIZE_T ns) :
+   disk(d), cachesize(cs),
+   curtime(0), diskfree(0),
+   allocs(0), deallocs(0),
+   flusherrunning(false), flusherstop(false), flushpending(false),
+   attached(false), warmblocks(0), warmuptime(0),
+   mrc(0),
+   arenapages(ARENA_PAGES_NORMAL), arenamapped(ARENA_PAGES_NORMAL),
+   arenabase(0), arenalen(0),
+   uppershare(0), resizes(0),
+   tunetarget(0), tunemaxbytes(0), tuneaccesses(0), tunemisses(0)
+{
+  // every shard needs room for at least one block
+  SIZE_T numshards = ns<1 ? 1 : ns>cs && cs>0 ? cs : ns;
+
+  for (SIZE_T i=0;i<numshards;i++) {
+    CacheShard *s=new CacheShard;
+
+    s->cachesize = cs/numshards + (i<cs%numshards ? 1 : 0);
+    s->policy=MakeReplacementPolicy(pt,s->cachesize);
+    if (!s->policy) {
+      delete s;
+      throw GenericException();
+    }
+    pthread_mutex_init(&(s->lock),0);
+    s->reads=s->writes=s->diskreads=s->diskwrites=0;
+    s->prefetches=s->prefetchhits=s->prefetchwaste=s->numprefetched=0;
+    s->readahead=true;
+    s->readaheads=s->readaheadblocks=s->readaheadhits=s->readaheadwaste=0;
+    s->numdirty=0;
+    s->highwater=s->lowwater=0;
+    s->flushes=s->flushedblocks=s->flusherrors=0;
+    s->flushtime=0;
+    s->dirtyclock=0;
+    s->useclock=0;
+    s->misses=0;
+    s->misstime=0;
+    s->reservesize=0;
+    s->numreserved=0;
+    s->probationsize=(SIZE_T)(SCAN_SHARE*s->cachesize);
+    if (s->probationsize<1) { 
+      s->probationsize=1;
+    }
+    s->scanblocks=s->scanpromotions=0;
+    s->tier=0;
+    s->tierlookups=s->tierhits=s->tierstores=0;
+    s->tierrawbytes=s->tierstoredbytes=0;
+    s->tiercputime=0;
+    s->arenaoverflows=0;
+    s->sharedreads=s->privatereads=s->unshares=0;
+    s->numslots=0;
+    s->resizeevictions=0;
+    s->batchmisses=s->batchruns=0;
+    ResetReadAhead(*s);
+    shards.push_back(s);
+  }
+  pthread_mutex_init(&disklock,0);
+  pthread_mutex_init(&flushlock,0);
+  pthread_cond_init(&flushwake,0);
+  pthread_mutex_init(&mrclock,0);
+  pthread_mutex_init(&sparelock,0);
+  SetUpperShare(UPPER_SHARE);
+}
+
+
+BufferCache::~BufferCache()
+{
+  if (disk) { 
+    Detach();
+  }
+  StopFlusher();
+  UnmapArena();
+  for (SIZE_T i=0;i<shards.size();i++) {
+    delete shards[i]->policy;
+    delete shards[i]->tier;
+    pthread_mutex_destroy(&(shards[i]->lock));
+    delete shards[i];
+  }
+  shards.clear();
+  delete mrc;
+  mrc=0;
+  pthread_mutex_destroy(&mrclock);
+  pthread_mutex_destroy(&sparelock);
+  pthread_cond_destroy(&flushwake);
+  pthread_mutex_destroy(&flushlock);
+  pthread_mutex_destroy(&disklock);
+  disk=0; cachesize=0; curtime=0;
+}
+
+ERROR_T BufferCache::Attach()
+{
+  SIZE_T i;
+  int rc=ERROR_NOERROR;
+
+  for (i=0;i<shards.size();i++) {
+    pthread_mutex_lock(&(shards[i]->lock));
+  }
+  for (i=0;i<shards.size();i++) {
+    CacheShard &s=*(shards[i]);
+
+    s.blockmap.clear();
+    s.blockmap.reserve(s.cachesize);
+    s.policy->Clear();
+    s.numprefetched=0;
+    s.numdirty=0;
+    s.numreserved=0;
+    s.reservedframes=FrameList();
+    s.probation=FrameList();
+    if (s.tier) { 
+      s.tier->Clear();
+    }
+    ResetReadAhead(s);
+  }
+  // without an arena, frames get buffers of their own
+  MapArena();
+  if (!manifest.empty()) {
+    rc=LoadManifest();
+  }
+  attached=true;
+  for (i=0;i<shards.size();i++) {
+    pthread_mutex_unlock(&(shards[i]->lock));
+  }
+  return rc;
+}
+
+ERROR_T BufferCache::Detach()
+{
+  StopFlusher();
+
+  // write out all of our data and then throw it away
+  // all shards are held so that one sweep covers them
+
+  vector<BufferFrame *> dirtyframes;
+  SIZE_T i;
+  int rc;
+
+  for (i=0;i<shards.size();i++) {
+    pthread_mutex_lock(&(shards[i]->lock));
+  }
+
+  for (i=0;i<shards.size();i++) {
+    for (BlockTable::iterator f=shards[i]->blockmap.begin();
+	 f!=shards[i]->blockmap.end();
+	 ++f) {
+      if ((*f).second.block.dirty) {
+	dirtyframes.push_back(&((*f).second));
+      }
+    }
+  }
+
+  rc=WriteBack(dirtyframes);
+
+  // only once per Attach, so that a second Detach does not
+  // replace the manifest with an empty one
+  if (rc==ERROR_NOERROR && attached && !manifest.empty()) {
+    rc=SaveManifest();
+  }
+
+  for (i=0;i<shards.size();i++) {
+    CacheShard &s=*(shards[i]);
+    if (rc==ERROR_NOERROR || rc==ERROR_NOFILE) {
+      for (BlockTable::iterator f=s.blockmap.begin();f!=s.blockmap.end();++f) { 
+	Settle(s,(*f).second);
+      }
+      attached=false;
+      s.blockmap.clear();
+      s.policy->Clear();
+      s.numprefetched=0;
+      s.numdirty=0;
+      s.numreserved=0;
+      s.reservedframes=FrameList();
+      s.probation=FrameList();
+      if (s.tier) { 
+	s.tier->Clear();
+      }
+      ResetReadAhead(s);
+    }
+  }
+  if (rc==ERROR_NOERROR || rc==ERROR_NOFILE) {
+    UnmapArena();
+  }
+  for (i=0;i<shards.size();i++) {
+    pthread_mutex_unlock(&(shards[i]->lock));
+  }
+  return rc;
+}
+
+
+//
+// Manifest of resident blocks, one block number per line, most
+// recently used first.  Called with all shard locks held.
+//
+ERROR_T BufferCache::SaveManifest()
+{
+  vector<pair<SIZE_T,SIZE_T> > order;
+  FILE *file;
+
+  for (SIZE_T i=0;i<shards.size();i++) {
+    for (BlockTable::const_iterator f=shards[i]->blockmap.begin();
+	 f!=shards[i]->blockmap.end();
+	 ++f) {
+      order.push_back(pair<SIZE_T,SIZE_T>((*f).second.lastuse,(*f).first));
+    }
+  }
+  // each shard keeps its own clock, but only the order within a
+  // shard matters when the manifest is loaded
+  sort(order.rbegin(),order.rend());
+
+  if ((file=fopen(manifest.c_str(),"w"))==0) {
+    return ERROR_NOFILE;
+  }
+  for (SIZE_T i=0;i<order.size();i++) {
+    fprintf(file,"%u\n",order[i].second);
+  }
+  fclose(file);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BufferCache::LoadManifest()
+{
+  FILE *file;
+  SIZE_T blocknum;
+  double start=curtime;
+
+  warmblocks=0;
+  warmuptime=0;
+
+  if ((file=fopen(manifest.c_str(),"r"))==0) {
+    // cold start
+    return ERROR_NOERROR;
+  }
+
+  // Keep the most recent blocks that fit in each shard
+  vector<vector<SIZE_T> > keep(shards.size());
+  vector<SIZE_T> wanted;
+  unordered_set<SIZE_T> seen;
+
+  while (fscanf(file,"%u",&blocknum)==1) {
+    vector<SIZE_T> &k=keep[ShardIndex(blocknum)];
+    if (blocknum>=disk->GetNumBlocks() ||
+	k.size()>=ShardOf(blocknum).cachesize ||
+	!seen.insert(blocknum).second) {
+      continue;
+    }
+    {
+      CacheGuard d(&disklock);
+      if (!disk->IsBlockAllocated(blocknum)) {
+	continue;
+      }
+    }
+    k.push_back(blocknum);
+    wanted.push_back(blocknum);
+  }
+  fclose(file);
+
+  // Read them in block order, a run of consecutive blocks at a time
+  unordered_map<SIZE_T, Block, cache_hash> loaded;
+  SIZE_T i=0;
+
+  sort(wanted.begin(),wanted.end());
+  while (i<wanted.size()) {
+    SIZE_T num=1;
+    while (i+num<wanted.size() &&
+	   num<WARMUP_MAX_RUN &&
+	   wanted[i+num]==wanted[i]+num) {
+      num++;
+    }
+
+    vector<Block> blocks;
+    double reqtime;
+    int rc;
+    {
+      CacheGuard d(&disklock);
+      rc=disk->Read(wanted[i],
+		    num,
+		    blocks,
+		    reqtime);
+      ChargeDisk(reqtime);
+    }
+    ShardOf(wanted[i]).diskreads++;
+    if (rc!=ERROR_NOERROR) {
+      return rc;
+    }
+    for (SIZE_T j=0;j<num;j++) {
+      loaded[wanted[i+j]]=blocks[j];
+    }
+    i+=num;
+  }
+
+  // Insert them oldest first so that the policies see them in
+  // the order they were last used
+  for (SIZE_T n=0;n<shards.size();n++) {
+    CacheShard &s=*(shards[n]);
+    for (vector<SIZE_T>::reverse_iterator b=keep[n].rbegin(); b!=keep[n].rend(); ++b) {
+      BufferFrame &f=NewFrame(s,*b);
+      f.block=loaded[*b];
+      f.block.lastaccessed=curtime;
+      f.block.dirty=false;
+      f.lastuse=++s.useclock;
+      s.policy->Insert(&f);
+      warmblocks++;
+    }
+  }
+
+  warmuptime=curtime-start;
+  return ERROR_NOERROR;
+}
+
+
+SIZE_T BufferCache::GetCacheSize() const
+{
+  return cachesize;
+}
+
+
+ERROR_T BufferCache::SetCacheSize(const SIZE_T newsize)
+{
+  SIZE_T numshards=shards.size();
+  SIZE_T i;
+  ERROR_T rc=ERROR_NOERROR;
+
+  // every shard needs room for at least one block
+  if (newsize<numshards) { 
+    return ERROR_SIZE;
+  }
+
+  for (i=0;i<numshards;i++) {
+    pthread_mutex_lock(&(shards[i]->lock));
+  }
+  cachesize=newsize;
+  for (i=0;i<numshards;i++) {
+    CacheShard &s=*(shards[i]);
+    SIZE_T before=s.blockmap.size();
+
+    s.cachesize = newsize/numshards + (i<newsize%numshards ? 1 : 0);
+    s.policy->SetCacheSize(s.cachesize);
+    s.probationsize=(SIZE_T)(SCAN_SHARE*s.cachesize);
+    if (s.probationsize<1) { 
+      s.probationsize=1;
+    }
+    // reserved frames cannot be evicted, so shed them first
+    ApplyUpperShare(s);
+    if (rc==ERROR_NOERROR) { 
+      rc=MakeRoom(s,0);
+    }
+    if (s.blockmap.size()<before) { 
+      s.resizeevictions+=before-s.blockmap.size();
+    }
+    // free slots over the new size are spare
+    while (s.numslots>s.cachesize && !s.freeslots.empty()) { 
+      BYTE_T *slot=s.freeslots.back();
+      s.freeslots.pop_back();
+      ReleaseSlot(s,slot);
+    }
+  }
+  if (arenabase) { 
+    ERROR_T grc=GrowArena();
+    if (rc==ERROR_NOERROR) { 
+      rc=grc;
+    }
+  }
+  resizes++;
+  for (i=0;i<numshards;i++) {
+    pthread_mutex_unlock(&(shards[i]->lock));
+  }
+  return rc;
+}
+
+
+void BufferCache::SetAutoTune(const double targethitrate, const SIZE_T maxbytes)
+{
+  tunetarget=targethitrate;
+  tunemaxbytes=maxbytes;
+  tuneaccesses=GetNumReads()+GetNumWrites();
+  tunemisses=GetNumMisses();
+}
+
+
+ERROR_T BufferCache::AutoTune()
+{
+  SIZE_T accesses=GetNumReads()+GetNumWrites();
+  SIZE_T misses=GetNumMisses();
+  SIZE_T maxsize = tunemaxbytes>0 ? tunemaxbytes/GetBlockSize() : 0;
+  SIZE_T minsize = shards.size();
+  SIZE_T size=cachesize;
+
+  if (tunetarget<=0 && tunemaxbytes==0) { 
+    return ERROR_NOERROR;
+  }
+  if (tunetarget>0 && accesses-tuneaccesses>=AUTOTUNE_PERIOD) { 
+    double hitrate=1-(double)(misses-tunemisses)/(accesses-tuneaccesses);
+
+    tuneaccesses=accesses;
+    tunemisses=misses;
+    if (HasMissRatioCurve()) { 
+      // the estimate only falls as the size grows
+      SIZE_T lo=minsize;
+      SIZE_T hi=GetEstimatedFootprint();
+
+      if (maxsize>0 && hi>maxsize) { 
+	hi=maxsize;
+      }
+      if (hi<lo) { 
+	hi=lo;
+      }
+      while (lo<hi) { 
+	SIZE_T mid=lo+(hi-lo)/2;
+	if (1-GetEstimatedMissRatio(mid)>=tunetarget) { 
+	  hi=mid;
+	} else {
+	  lo=mid+1;
+	}
+      }
+      size=lo;
+    } else {
+      SIZE_T step=(SIZE_T)(AUTOTUNE_STEP*cachesize);
+
+      if (step<1) { 
+	step=1;
+      }
+      if (hitrate<tunetarget) { 
+	size=cachesize+step;
+      } else if (hitrate>tunetarget+AUTOTUNE_SLACK) { 
+	size = cachesize>minsize+step ? cachesize-step : minsize;
+      }
+    }
+  }
+  if (maxsize>0 && size>maxsize) { 
+    size=maxsize;
+  }
+  if (size<minsize) { 
+    size=minsize;
+  }
+  return size==cachesize ? ERROR_NOERROR : SetCacheSize(size);
+}
+
+
+SIZE_T BufferCache::GetBlockSize() const
+{
+  return disk->GetBlockSize();
+}
+
+SIZE_T BufferCache::GetNumBlocks() const
+{
+  return disk->GetNumBlocks();
+}
+
+double BufferCache::GetCurrentTime() const
+{
+  return curtime;
+}
+
+
+void BufferCache::SetMissRatioSampling(const double samplerate)
+{
+  CacheGuard m(&mrclock);
+
+  delete mrc;
+  mrc = samplerate>0 ? new MissRatioCurve(samplerate) : 0;
+}
+
+double BufferCache::GetEstimatedMissRatio(const SIZE_T size) const
+{
+  CacheGuard m(&mrclock);
+
+  return mrc ? mrc->GetMissRatio(size) : 0;
+}
+
+double BufferCache::GetEstimatedDiskTime(const SIZE_T size) const
+{
+  SIZE_T misses=GetNumMisses();
+  double cost = misses ? GetMissTime()/misses : 0;
+  CacheGuard m(&mrclock);
+
+  return mrc ? mrc->GetMisses(size)*cost : 0;
+}
+
+SIZE_T BufferCache::GetEstimatedFootprint() const
+{
+  CacheGuard m(&mrclock);
+
+  return mrc ? mrc->GetFootprint() : 0;
+}
+
+SIZE_T BufferCache::GetNumAllocs() const
+{
+  CacheGuard d(&disklock);
+
+  return allocs;
+}
+
+SIZE_T BufferCache::GetNumDeallocs() const
+{
+  CacheGuard d(&disklock);
+
+  return deallocs;
+}
+
+ERROR_T BufferCache::NotifyAllocateBlock(const SIZE_T outblocknum)
+{
+  CacheGuard d(&disklock);
+
+  allocs++;
+  return disk->NotifyAllocateBlocks(outblocknum,1);
+}
+
+ERROR_T BufferCache::NotifyDeallocateBlock(const SIZE_T inblocknum)
+{
+  CacheGuard d(&disklock);
+
+  deallocs++;
+  return disk->NotifyDeallocateBlocks(inblocknum,1);
+}
+
+
+bool  BufferCache::IsBlockAllocated(const SIZE_T inblocknum)
+{
+  CacheGuard d(&disklock);
+
+  return disk->IsBlockAllocated(inblocknum);
+}
+
+
+//
+// Sequential and strided read-ahead
+//
+// Demand misses, and first hits on read-ahead blocks, form the
+// access stream that we watch.  Once two steps in a row have the
+// same small forward stride, each miss also brings in a window of
+// blocks further along the stream.  The window doubles when at least
+// half of the previous one was used and halves whenever a read-ahead
+// block is thrown away unused.  Each shard watches its own stream
+// and reads ahead only within itself.
+//
+SIZE_T BufferCache::ReadAheadWindow(CacheShard &s, const SIZE_T inblocknum)
+{
+  SIZE_T stride = inblocknum>s.lastaccess ? inblocknum-s.lastaccess : 0;
+  bool   first  = (s.lastaccess==(SIZE_T)-1);
+
+  s.lastaccess=inblocknum;
+
+  if (first || stride==0 || stride>READAHEAD_MAX_STRIDE || stride!=s.rastride) { 
+    s.rastride = (first || stride>READAHEAD_MAX_STRIDE) ? 0 : stride;
+    return 1;
+  }
+
+  if (s.rawindowhits*2>=s.rawindowsize && s.rawindowsize>0) { 
+    s.rawindow*=2;
+  }
+  SIZE_T maxwindow = s.cachesize/4<READAHEAD_MAX_WINDOW ? s.cachesize/4 : READAHEAD_MAX_WINDOW;
+  if (Scanning() && maxwindow>=s.probationsize) { 
+    // the whole window has to fit on the probation list
+    maxwindow = s.probationsize-1;
+  }
+  if (s.rawindow>maxwindow) { 
+    s.rawindow=maxwindow;
+  }
+  if (s.rawindow<READAHEAD_MIN_WINDOW) { 
+    s.rawindow = READAHEAD_MIN_WINDOW<=maxwindow ? READAHEAD_MIN_WINDOW : maxwindow;
+  }
+  s.rawindowhits=0;
+  s.rawindowsize=s.rawindow;
+  return s.rawindow+1;
+}
+
+
+void BufferCache::ResetReadAhead(CacheShard &s)
+{
+  s.lastaccess=(SIZE_T)-1;
+  s.rastride=0;
+  s.rawindow=READAHEAD_MIN_WINDOW;
+  s.rawindowsize=s.rawindowhits=0;
+}
+
+
+void BufferCache::ShrinkReadAhead(CacheShard &s)
+{
+  s.readaheadwaste++;
+  s.rawindow/=2;
+}
+
+
+void BufferCache::SetReadAhead(const bool enable)
+{
+  for (SIZE_T i=0;i<shards.size();i++) {
+    CacheGuard g(&(shards[i]->lock));
+    shards[i]->readahead=enable;
+  }
+}
+
+
+//
+// Install a block that arrived through read-ahead
+//
+ERROR_T BufferCache::InstallReadAhead(CacheShard &s, const SIZE_T blocknum, const Block &block, const double readyat)
+{
+  ERROR_T rc;
+
+  s.policy->Miss(blocknum);
+  if ((rc=MakeRoom(s))!=ERROR_NOERROR) { 
+    return rc;
+  }
+  BufferFrame &g=NewFrame(s,blocknum);
+  g.block=block;
+  g.readahead=true;
+  g.readyat=readyat;
+  if (s.tier) { 
+    // the disk copy is as good as the one in the tier
+    s.tier->Erase(blocknum);
+  }
+  g.block.lastaccessed=curtime;
+  g.block.dirty=false;
+  g.lastuse=++s.useclock;
+  Admit(s,g);
+  s.readaheadblocks++;
+  return ERROR_NOERROR;
+}
+
+
+//
+// Give a frame one of the shard's upper level slots if it is an
+// upper level block and one is free, or take the slot back if the
+// block is no longer one.  A reserved frame cannot be evicted, so
+// it is taken off the policy's lists, or the probation list, onto
+// the shard's own, and victim searches never walk past it.
+//
+void BufferCache::ApplyHint(CacheShard &s, BufferFrame &f, const AccessHint hint)
+{
+  if (hint!=HINT_NONE) { 
+    f.hint=hint;
+  }
+  if (IsUpperLevel(f.hint)) { 
+    if (!f.reserved && s.numreserved<s.reservesize) { 
+      if (f.scan) { 
+	s.probation.Remove(&f);
+      } else {
+	s.policy->Remove(&f,false);
+      }
+      f.reserved=true;
+      s.numreserved++;
+      s.reservedframes.PushFront(&f);
+    }
+  } else {
+    Unreserve(s,f);
+  }
+}
+
+void BufferCache::Unreserve(CacheShard &s, BufferFrame &f)
+{
+  if (f.reserved) { 
+    s.reservedframes.Remove(&f);
+    f.reserved=false;
+    s.numreserved--;
+    // back to the list it was taken from
+    if (f.scan) { 
+      s.probation.PushFront(&f);
+    } else {
+      s.policy->Insert(&f);
+    }
+  }
+}
+
+
+//
+// A block just brought in goes to the policy, or to the probation
+// list if this thread is scanning.  Promote moves it from probation
+// to the policy, and Forget takes it off whichever it is on,
+// including the reserved list.
+//
+void BufferCache::Admit(CacheShard &s, BufferFrame &f)
+{
+  if (Scanning()) { 
+    f.scan=true;
+    s.probation.PushFront(&f);
+    s.scanblocks++;
+  } else {
+    s.policy->Insert(&f);
+  }
+}
+
+void BufferCache::Promote(CacheShard &s, BufferFrame &f)
+{
+  if (f.reserved) { 
+    // goes to the policy when the slot is given back
+    f.scan=false;
+    s.scanpromotions++;
+    return;
+  }
+  s.probation.Remove(&f);
+  f.scan=false;
+  s.policy->Miss(f.blocknum);
+  s.policy->Insert(&f);
+  s.scanpromotions++;
+}
+
+void BufferCache::Forget(CacheShard &s, BufferFrame &f, const bool evicted)
+{
+  if (evicted) { 
+    CountBlock(f.blocknum,&BlockStats::evictions);
+  }
+  if (f.reserved) { 
+    s.reservedframes.Remove(&f);
+    f.reserved=false;
+    s.numreserved--;
+  } else if (f.scan) { 
+    s.probation.Remove(&f);
+    f.scan=false;
+  } else {
+    s.policy->Remove(&f,evicted);
+  }
+}
+
+// Scanned blocks go first
+BufferFrame *BufferCache::ChooseVictim(CacheShard &s, const bool clean)
+{
+  BufferFrame *victim=s.probation.OldestEvictable();
+
+  if (victim && !(clean && victim->block.dirty)) { 
+    return victim;
+  }
+  return s.policy->Victim(clean);
+}
+
+
+//
+// Keep a clean block that is being evicted in the compressed tier,
+// and take one back out on a miss
+//
+void BufferCache::Stash(CacheShard &s, BufferFrame &f)
+{
+  if (!s.tier || f.scan || f.block.dirty || Settle(s,f)!=ERROR_NOERROR) { 
+    return;
+  }
+
+  double start=CPUTime();
+  SIZE_T size=s.tier->Put(f.blocknum,f.block);
+
+  s.tiercputime+=CPUTime()-start;
+  if (size>0) { 
+    s.tierstores++;
+    s.tierrawbytes+=f.block.length;
+    s.tierstoredbytes+=size;
+  }
+}
+
+bool BufferCache::Unstash(CacheShard &s, const SIZE_T blocknum, Block &block)
+{
+  if (!s.tier) { 
+    return false;
+  }
+  s.tierlookups++;
+  if (!s.tier->Contains(blocknum)) { 
+    return false;
+  }
+
+  double start=CPUTime();
+  ERROR_T rc=s.tier->Get(blocknum,block);
+
+  s.tiercputime+=CPUTime()-start;
+  if (rc!=ERROR_NOERROR) { 
+    return false;
+  }
+  s.tierhits++;
+  return true;
+}
+
+void BufferCache::SetCompressedTier(const SIZE_T blocks)
+{
+  for (SIZE_T i=0;i<shards.size();i++) { 
+    CacheShard &s=*(shards[i]);
+    CacheGuard g(&(s.lock));
+    SIZE_T share = blocks/shards.size() + (i<blocks%shards.size() ? 1 : 0);
+
+    delete s.tier;
+    s.tier = share>0 ? new CompressedTier(share*GetBlockSize()) : 0;
+  }
+}
+
+SIZE_T BufferCache::GetNumTierBlocks() const
+{
+  SIZE_T total=0;
+
+  for (SIZE_T i=0;i<shards.size();i++) { 
+    CacheGuard g(&(shards[i]->lock));
+    if (shards[i]->tier) { 
+      total+=shards[i]->tier->GetNumBlocks();
+    }
+  }
+  return total;
+}
+
+
+//
+// Frames take their data from the shard's slice of the arena while
+// it lasts, and give it back when they leave the cache
+//
+BufferFrame &BufferCache::NewFrame(CacheShard &s, const SIZE_T blocknum)
+{
+  BufferFrame &f=s.blockmap[blocknum];
+
+  f.blocknum=blocknum;
+  if (!f.slot) { 
+    if (!s.freeslots.empty()) { 
+      f.slot=s.freeslots.back();
+      s.freeslots.pop_back();
+      f.block.Borrow(f.slot,GetBlockSize());
+    } else if (arenabase) { 
+      s.arenaoverflows++;
+    }
+  }
+  return f;
+}
+
+void BufferCache::FreeFrame(CacheShard &s, const SIZE_T blocknum)
+{
+  BlockTable::iterator b=s.blockmap.find(blocknum);
+
+  if (b==s.blockmap.end()) { 
+    return;
+  }
+  // the slot may not be reused under a read
+  Settle(s,(*b).second);
+  if ((*b).second.slot) { 
+    ReleaseSlot(s,(*b).second.slot);
+  }
+  s.blockmap.erase(b);
+}
+
+
+//
+// One region for the frames of all the shards.  For transparent
+// huge pages it is mapped a huge page larger than needed, so that
+// it can start on a huge page boundary.
+//
+ERROR_T BufferCache::MapArena()
+{
+  size_t need=(size_t)cachesize*GetBlockSize();
+  BYTE_T *arena=0;
+
+  UnmapArena();
+  if (need==0) { 
+    return ERROR_NOERROR;
+  }
+#ifdef MAP_HUGETLB
+  if (arenapages==ARENA_PAGES_HUGE) { 
+    arenalen=(need+ARENA_HUGE_PAGE-1)/ARENA_HUGE_PAGE*ARENA_HUGE_PAGE;
+    arenabase=mmap(0,arenalen,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB,-1,0);
+    if (arenabase!=MAP_FAILED) { 
+      arenamapped=ARENA_PAGES_HUGE;
+      arena=(BYTE_T *)arenabase;
+    }
+  }
+#endif
+  if (!arena) { 
+    arenalen = arenapages==ARENA_PAGES_NORMAL ? need : need+ARENA_HUGE_PAGE;
+    arenabase=mmap(0,arenalen,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if (arenabase==MAP_FAILED) { 
+      arenabase=0;
+      arenalen=0;
+      return ERROR_NOMEM;
+    }
+    arena=(BYTE_T *)arenabase;
+    arenamapped=ARENA_PAGES_NORMAL;
+#ifdef MADV_HUGEPAGE
+    if (arenapages!=ARENA_PAGES_NORMAL) { 
+      size_t skip=(ARENA_HUGE_PAGE-(size_t)arena%ARENA_HUGE_PAGE)%ARENA_HUGE_PAGE;
+      arena+=skip;
+      if (madvise(arena,arenalen-skip,MADV_HUGEPAGE)==0) { 
+	arenamapped=ARENA_PAGES_THP;
+      }
+    }
+#endif
+  }
+
+  // lowest addresses are handed out first
+  for (SIZE_T i=0;i<shards.size();i++) { 
+    CacheShard &s=*(shards[i]);
+    s.freeslots.clear();
+    s.freeslots.reserve(s.cachesize);
+    for (SIZE_T j=s.cachesize;j>0;j--) { 
+      s.freeslots.push_back(arena+(j-1)*GetBlockSize());
+    }
+    s.numslots=s.cachesize;
+    arena+=s.cachesize*GetBlockSize();
+  }
+  return ERROR_NOERROR;
+}
+
+void BufferCache::UnmapArena()
+{
+  for (SIZE_T i=0;i<shards.size();i++) { 
+    shards[i]->freeslots.clear();
+    shards[i]->numslots=0;
+  }
+  if (arenabase) { 
+    munmap(arenabase,arenalen);
+    arenabase=0;
+    arenalen=0;
+  }
+  for (SIZE_T i=0;i<arenagrowth.size();i++) { 
+    munmap(arenagrowth[i].first,arenagrowth[i].second);
+  }
+  arenagrowth.clear();
+  spareslots.clear();
+}
+
+
+//
+// Deals each shard the slots it is short of since the cache grew,
+// spare ones first and then from a new region
+//
+ERROR_T BufferCache::GrowArena()
+{
+  SIZE_T missing=0;
+  SIZE_T i;
+  CacheGuard p(&sparelock);
+
+  for (i=0;i<shards.size();i++) { 
+    if (shards[i]->numslots<shards[i]->cachesize) { 
+      missing+=shards[i]->cachesize-shards[i]->numslots;
+    }
+  }
+  if (missing>spareslots.size()) { 
+    SIZE_T n=missing-spareslots.size();
+    size_t len=(size_t)n*GetBlockSize();
+    void *base=mmap(0,len,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+
+    if (base==MAP_FAILED) { 
+      return ERROR_NOMEM;
+    }
+    arenagrowth.push_back(pair<void *, size_t>(base,len));
+    // lowest addresses are handed out first
+    for (SIZE_T j=n;j>0;j--) { 
+      spareslots.push_back((BYTE_T *)base+(j-1)*GetBlockSize());
+    }
+  }
+  for (i=0;i<shards.size();i++) { 
+    CacheShard &s=*(shards[i]);
+    while (s.numslots<s.cachesize) { 
+      s.freeslots.push_back(spareslots.back());
+      spareslots.pop_back();
+      s.numslots++;
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+//
+// A slot that has left its frame goes back to the shard, or to the
+// spares if the shard has shrunk since it was dealt.  The whole
+// pages of a spare slot are given back to the system.
+//
+void BufferCache::ReleaseSlot(CacheShard &s, BYTE_T *slot)
+{
+  if (s.numslots<=s.cachesize) { 
+    s.freeslots.push_back(slot);
+    return;
+  }
+
+  size_t page=sysconf(_SC_PAGESIZE);
+  size_t lo=((size_t)slot+page-1)/page*page;
+  size_t hi=((size_t)slot+GetBlockSize())/page*page;
+
+  if (hi>lo) { 
+    madvise((void *)lo,hi-lo,MADV_DONTNEED);
+  }
+  s.numslots--;
+  CacheGuard p(&sparelock);
+  spareslots.push_back(slot);
+}
+
+void BufferCache::BeginScan()
+{
+  scandepth++;
+}
+
+void BufferCache::EndScan()
+{
+  if (scandepth>0) { 
+    scandepth--;
+  }
+}
+
+ERROR_T BufferCache::SetBlockHint(const SIZE_T inblocknum, const AccessHint hint)
 {
-  // In a real buffer cache, we would use a priority queue to make this O(1)
+  CacheShard &s=ShardOf(inblocknum);
+  CacheGuard g(&(s.lock));
+  BlockTable::iterator b;
 
-  map<SIZE_T, Block, cache_compare_lessthan>::iterator oldestptr=blockmap.end();
-  double oldest = curtime+1;
+  b = s.blockmap.find(inblocknum);
 
-  // Only delete if the cache is full
-  if (blockmap.size() < cachesize) {
-    return ERROR_NOERROR;
+  if (b==s.blockmap.end()) { 
+    return ERROR_NOSUCHBLOCK;
   }
+  ApplyHint(s,(*b).second,hint);
+  return ERROR_NOERROR;
+}
 
-  // Find oldest
+void BufferCache::SetUpperShare(const double share)
+{
+  uppershare=share;
+  for (SIZE_T i=0;i<shards.size();i++) { 
+    CacheShard &s=*(shards[i]);
+    CacheGuard g(&(s.lock));
 
-  for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
-	 i!=blockmap.end();
-	 ++i) {
-       if ((*i).second.lastaccessed<oldest) { 
-	 oldestptr=i;
-	 oldest=(*i).second.lastaccessed;
-       }
+    ApplyUpperShare(s);
   }
-  
-  // write and delete it if it exists
- 
-  if (oldestptr!=blockmap.end()) { 
-    if ((*oldestptr).second.dirty) {
-      double reqtime;
-      int rc=disk->Write((*oldestptr).first,
-			 (*oldestptr).second,
-			 reqtime);
-      curtime+=reqtime;
-      diskwrites++;
-      if (rc!=ERROR_NOERROR) { 
+}
+
+void BufferCache::ApplyUpperShare(CacheShard &s)
+{
+  // at least one slot is always left to the policy
+  s.reservesize = uppershare<=0 ? 0 : (SIZE_T)(uppershare*s.cachesize);
+  if (s.reservesize>=s.cachesize) { 
+    s.reservesize=s.cachesize-1;
+  }
+  // release slots over the new share
+  for (BlockTable::iterator b=s.blockmap.begin();
+       b!=s.blockmap.end() && s.numreserved>s.reservesize;
+       ++b) {
+    Unreserve(s,(*b).second);
+  }
+}
+
+ERROR_T BufferCache::FetchFrame(CacheShard &s, const SIZE_T inblocknum, BufferFrame *&outframe,
+			       const AccessHint hint)
+{
+  BlockTable::iterator b;
+  Block tierblock;
+
+  b = s.blockmap.find(inblocknum);
+
+  if (b!=s.blockmap.end()) {
+    // It's in  cache, just update its lastaccessed and return it
+    ERROR_T rc;
+    outframe=&((*b).second);
+    if ((rc=Settle(s,*outframe))!=ERROR_NOERROR) { 
+      return rc;
+    }
+    if (outframe->readyat>curtime) { 
+      // wait for the rest of a prefetch
+      WaitUntil(outframe->readyat);
+    }
+    outframe->block.lastaccessed=curtime;
+    if (outframe->prefetched) { 
+      // The prefetch inserted it, so this is its first reference
+      outframe->prefetched=false;
+      s.numprefetched--;
+      s.prefetchhits++;
+    } else if (outframe->readahead) { 
+      // Likewise for read-ahead, which also continues the stream
+      outframe->readahead=false;
+      s.readaheadhits++;
+      s.rawindowhits++;
+      s.lastaccess=inblocknum;
+    } else if (outframe->reserved) { 
+      s.reservedframes.MoveToFront(outframe);
+    } else if (!Scanning() && !outframe->scan) {
+      s.policy->Touch(outframe);
+    }
+    if (outframe->scan && !Scanning()) { 
+      Promote(s,*outframe);
+    }
+    ApplyHint(s,*outframe,hint);
+    outframe->lastuse=++s.useclock;
+    s.reads++;
+    CountBlock(inblocknum,&BlockStats::reads);
+    RecordAccess(inblocknum);
+    return ERROR_NOERROR;
+  } else if (Unstash(s,inblocknum,tierblock)) {
+    // Evicted earlier and kept in the compressed tier
+    ERROR_T rc;
+    s.policy->Miss(inblocknum);
+    if ((rc=MakeRoom(s))!=ERROR_NOERROR) { 
+      return rc;
+    }
+    RecordAccess(inblocknum);
+
+    BufferFrame &f=NewFrame(s,inblocknum);
+    f.block=tierblock;
+    f.readyat=curtime;
+    f.block.lastaccessed=curtime;
+    f.block.dirty=false;
+    f.lastuse=++s.useclock;
+    Admit(s,f);
+    ApplyHint(s,f,hint);
+    s.reads++;
+    CountBlock(inblocknum,&BlockStats::reads);
+    outframe=&f;
+    return ERROR_NOERROR;
+  } else {
+    // It's not in cache, so time to allocate it
+    SIZE_T window = s.readahead ? ReadAheadWindow(s,inblocknum) : 1;
+    SIZE_T num=1;
+
+    if (window>1 && s.rastride==1) { 
+      // one request for the block and the run of uncached blocks after it
+      CacheGuard d(&disklock);
+      while (num<window && 
+	     inblocknum+num<disk->GetNumBlocks() &&
+	     &ShardOf(inblocknum+num)==&s &&
+	     disk->IsBlockAllocated(inblocknum+num) &&
+	     s.blockmap.find(inblocknum+num)==s.blockmap.end()) { 
+	num++;
+      }
+    }
+
+    double missstart=curtime;
+    int rc;
+
+    s.policy->Miss(inblocknum);
+    if ((rc=MakeRoom(s))!=ERROR_NOERROR) { 
+      return rc;
+    }
+
+    BufferFrame &f=NewFrame(s,inblocknum);
+    vector<Block> blocks;
+    double reqtime;
+    {
+      CacheGuard d(&disklock);
+      // read it from disk straight into a new frame
+      if (!(disk->IsBlockAllocated(inblocknum))) {
+	if (PRINT_BUFFERCACHE_ALLOCATION_ERRORS) {
+	  cerr << "BufferCache::ReadBlock: Attempt to read unallocated block " << inblocknum<<endl;
+	}
+      }
+      if (num>1) {
+	rc = disk->Read(inblocknum,
+			num,
+			blocks,
+			reqtime);
+	if (rc==ERROR_NOERROR) {
+	  f.block=blocks[0];
+	}
+      } else {
+	rc = disk->Read(inblocknum,
+			f.block,
+			reqtime);
+      }
+      ChargeDisk(reqtime);
+    }
+    if (num>1) { 
+      s.readaheads++;
+    }
+    s.diskreads++;
+    if (rc!=ERROR_NOERROR) { 
+      FreeFrame(s,inblocknum);
+      return rc;
+    }
+    s.misses++;
+    s.misstime+=curtime-missstart;
+    CountBlock(inblocknum,&BlockStats::misses);
+    RecordAccess(inblocknum);
+
+    f.readyat=curtime;
+    f.block.lastaccessed=curtime;
+    f.block.dirty=false;
+    f.lastuse=++s.useclock;
+    Admit(s,f);
+    ApplyHint(s,f,hint);
+    s.reads++;
+    CountBlock(inblocknum,&BlockStats::reads);
+    outframe=&f;
+
+    // Keep the demanded block while the read-ahead makes room
+    f.pincount++;
+    for (SIZE_T i=1;i<num;i++) { 
+      if ((rc=InstallReadAhead(s,inblocknum+i,blocks[i],curtime))!=ERROR_NOERROR) { 
+	f.pincount--;
 	return rc;
       }
     }
-    blockmap.erase(oldestptr);
+    if (window>1 && s.rastride>1) { 
+      // Strided: queue the blocks one by one behind this request
+      s.readaheads++;
+      for (SIZE_T i=1;i<window;i++) { 
+	SIZE_T next=inblocknum+i*s.rastride;
+	Block block;
+	double readyat;
+	if (next>=disk->GetNumBlocks() || &ShardOf(next)!=&s) {
+	  break;
+	}
+	if (s.blockmap.find(next)!=s.blockmap.end()) { 
+	  continue;
+	}
+	{
+	  CacheGuard d(&disklock);
+	  if (!disk->IsBlockAllocated(next) ||
+	      disk->Read(next,block,reqtime)!=ERROR_NOERROR) {
+	    break;
+	  }
+	  readyat=ScheduleDisk(reqtime);
+	}
+	s.diskreads++;
+	if ((rc=InstallReadAhead(s,next,block,readyat))!=ERROR_NOERROR) { 
+	  f.pincount--;
+	  return rc;
+	}
+      }
+    }
+    f.pincount--;
+    return ERROR_NOERROR;
   }
-  return ERROR_NOERROR;
 }
 
-BufferCache::BufferCache(DiskSystem *d,
-			 SIZE_T cs) : 
-   disk(d), cachesize(cs), curtime(0),
-   allocs(0), deallocs(0), reads(0), writes(0),
-   diskreads(0), diskwrites(0)
-{}
 
+ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock, const AccessHint hint) 
+{
+  CacheShard &s=ShardOf(inblocknum);
+  CacheGuard g(&(s.lock));
+  BufferFrame *f;
+  ERROR_T rc=FetchFrame(s,inblocknum,f,hint);
 
-BufferCache::~BufferCache()
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+  outblock=f->block;
+  return ERROR_NOERROR;
+}
+
+
+//
+// Hits are served first, in the order given, so that the misses
+// cannot push them out.  The misses are then sorted in elevator
+// order from the disk head, and each run of consecutive blocks in
+// one shard, up to READBATCH_MAX_RUN and the shard's size, is read
+// in one request.  The blocks of a run are copied out as soon as
+// they are in, since later runs may evict them.
+//
+ERROR_T BufferCache::ReadBlocks(const vector<SIZE_T> &blocknums, vector<Block> &outblocks,
+				const AccessHint hint)
 {
-  if (disk) { 
-    Detach();
+  unordered_map<SIZE_T, vector<SIZE_T>, cache_hash> wanted;
+  vector<SIZE_T> misses;
+  ERROR_T rc;
+  SIZE_T i;
+
+  outblocks.resize(blocknums.size());
+  for (i=0;i<blocknums.size();i++) { 
+    CacheShard &s=ShardOf(blocknums[i]);
+    CacheGuard g(&(s.lock));
+    BufferFrame *f;
+
+    if (s.blockmap.find(blocknums[i])==s.blockmap.end() &&
+	!(s.tier && s.tier->Contains(blocknums[i]))) { 
+      vector<SIZE_T> &w=wanted[blocknums[i]];
+      if (w.empty()) { 
+	misses.push_back(blocknums[i]);
+      }
+      w.push_back(i);
+      continue;
+    }
+    if ((rc=FetchFrame(s,blocknums[i],f,hint))!=ERROR_NOERROR) { 
+      return rc;
+    }
+    outblocks[i]=f->block;
   }
-  disk=0; cachesize=0; curtime=0;
+
+  {
+    CacheGuard d(&disklock);
+    sort(misses.begin(),misses.end(),ElevatorOrder(disk));
+  }
+
+  i=0;
+  while (i<misses.size()) { 
+    CacheShard &s=ShardOf(misses[i]);
+    CacheGuard g(&(s.lock));
+    BufferFrame *f;
+
+    if (s.blockmap.find(misses[i])!=s.blockmap.end() ||
+	(s.tier && s.tier->Contains(misses[i]))) { 
+      // brought in since it was looked for
+      if ((rc=FetchFrame(s,misses[i],f,hint))!=ERROR_NOERROR) { 
+	return rc;
+      }
+      for (SIZE_T k=0;k<wanted[misses[i]].size();k++) { 
+	outblocks[wanted[misses[i]][k]]=f->block;
+      }
+      i++;
+      continue;
+    }
+
+    SIZE_T num=1;
+    while (i+num<misses.size() && num<READBATCH_MAX_RUN && num<s.cachesize &&
+	   misses[i+num]==misses[i]+num &&
+	   &ShardOf(misses[i+num])==&s &&
+	   s.blockmap.find(misses[i+num])==s.blockmap.end() &&
+	   !(s.tier && s.tier->Contains(misses[i+num]))) { 
+      num++;
+    }
+
+    double missstart=curtime;
+    vector<BufferFrame *> frames;
+    vector<Block> blocks;
+    double reqtime;
+
+    for (SIZE_T k=0;k<num;k++) { 
+      s.policy->Miss(misses[i+k]);
+    }
+    if ((rc=MakeRoom(s,num))!=ERROR_NOERROR) { 
+      return rc;
+    }
+    for (SIZE_T k=0;k<num;k++) { 
+      frames.push_back(&NewFrame(s,misses[i+k]));
+    }
+    {
+      CacheGuard d(&disklock);
+      for (SIZE_T k=0;k<num;k++) { 
+	if (!(disk->IsBlockAllocated(misses[i+k]))) {
+	  if (PRINT_BUFFERCACHE_ALLOCATION_ERRORS) {
+	    cerr << "BufferCache::ReadBlocks: Attempt to read unallocated block " << misses[i+k]<<endl;
+	  }
+	}
+      }
+      if (num>1) { 
+	rc=disk->Read(misses[i],num,blocks,reqtime);
+      } else {
+	// straight into the frame, as ReadBlock does
+	rc=disk->Read(misses[i],frames[0]->block,reqtime);
+      }
+      ChargeDisk(reqtime);
+    }
+    s.diskreads++;
+    if (rc!=ERROR_NOERROR) { 
+      for (SIZE_T k=0;k<num;k++) { 
+	FreeFrame(s,misses[i+k]);
+      }
+      return rc;
+    }
+    s.batchruns++;
+    for (SIZE_T k=0;k<num;k++) { 
+      SIZE_T b=misses[i+k];
+      BufferFrame &nf=*frames[k];
+
+      if (num>1) { 
+	nf.block=blocks[k];
+      }
+      nf.readyat=curtime;
+      nf.block.lastaccessed=curtime;
+      nf.block.dirty=false;
+      nf.lastuse=++s.useclock;
+      Admit(s,nf);
+      ApplyHint(s,nf,hint);
+      s.reads++;
+      s.misses++;
+      s.batchmisses++;
+      CountBlock(b,&BlockStats::reads);
+      CountBlock(b,&BlockStats::misses);
+      RecordAccess(b);
+      for (SIZE_T j=0;j<wanted[b].size();j++) { 
+	outblocks[wanted[b][j]]=nf.block;
+      }
+    }
+    s.misstime+=curtime-missstart;
+    i+=num;
+  }
+  return ERROR_NOERROR;
 }
 
-ERROR_T BufferCache::Attach()
+
+ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, BlockRef &outref, const AccessHint hint) 
 {
-  blockmap.clear();
+  outref.Release();
+
+  CacheShard &s=ShardOf(inblocknum);
+  CacheGuard g(&(s.lock));
+  BufferFrame *f;
+  ERROR_T rc=FetchFrame(s,inblocknum,f,hint);
+
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+  outref.cache=this;
+  outref.blocknum=inblocknum;
+  if (f->pincount>f->sharers || f->block.length<=BLOCK_INLINE_SIZE) { 
+    // may be written in place, or too small to be worth sharing
+    outref.block=f->block;
+    outref.shared=false;
+    s.privatereads++;
+  } else {
+    outref.block.Borrow(f->block.data,f->block.length);
+    outref.shared=true;
+    f->sharers++;
+    f->pincount++;
+    s.sharedreads++;
+  }
+  outref.block.lastaccessed=f->block.lastaccessed;
+  outref.block.dirty=f->block.dirty;
   return ERROR_NOERROR;
 }
 
-ERROR_T BufferCache::Detach()
+
+//
+// Gives a frame whose bytes BlockRefs hold a buffer of its own,
+// copying the bytes over if asked, and leaves the old buffer to
+// the BlockRefs.  Their pins no longer hold the frame.
+//
+ERROR_T BufferCache::Unshare(CacheShard &s, BufferFrame &f, const bool copy)
 {
-  // write out all of our data and then throw it away
+  BYTE_T *old=f.block.data;
+  SIZE_T  len=f.block.length;
+  double  lastaccessed=f.block.lastaccessed;
+  bool    dirty=f.block.dirty;
+  DetachedBuffer d;
 
-  for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
-	 i!=blockmap.end();
-	 ++i) {
-    if ((*i).second.dirty) { 
-      double reqtime;
-      int rc=disk->Write((*i).first,
-			 (*i).second,
-			 reqtime);
-      curtime+=reqtime;
-      diskwrites++;
-      if (rc!=ERROR_NOERROR) { 
-	return rc;
-      }
+  d.sharers=f.sharers;
+  d.slot=0;
+  d.block=0;
+  if (f.slot && old==f.slot) { 
+    d.slot=f.slot;
+    f.slot=0;
+    if (!s.freeslots.empty()) { 
+      f.slot=s.freeslots.back();
+      s.freeslots.pop_back();
+      f.block.Borrow(f.slot,GetBlockSize());
+    } else {
+      f.block.Borrow(0,0);
+      s.arenaoverflows++;
+    }
+  } else {
+    // takes the heap buffer, which does not move
+    d.block=new Block(std::move(f.block));
+  }
+  if (f.block.Resize(len,false)!=ERROR_NOERROR) { 
+    // keep sharing the old buffer
+    if (d.slot) { 
+      f.slot=d.slot;
+      f.block.Borrow(f.slot,GetBlockSize());
+      f.block.Resize(len,false);
+    } else {
+      f.block=std::move(*(d.block));
+      delete d.block;
     }
+    f.block.lastaccessed=lastaccessed;
+    f.block.dirty=dirty;
+    return ERROR_NOMEM;
+  }
+  if (copy) { 
+    memcpy(f.block.data,old,len);
   }
-  blockmap.clear();
+  f.block.lastaccessed=lastaccessed;
+  f.block.dirty=dirty;
+  f.pincount-=f.sharers;
+  f.sharers=0;
+  s.detached[old]=d;
+  s.unshares++;
   return ERROR_NOERROR;
 }
 
 
-SIZE_T BufferCache::GetCacheSize() const
+void BufferCache::AddSharer(const BlockRef &ref)
 {
-  return cachesize;
+  CacheShard &s=ShardOf(ref.blocknum);
+  CacheGuard g(&(s.lock));
+  BlockTable::iterator b=s.blockmap.find(ref.blocknum);
+
+  if (b!=s.blockmap.end() && (*b).second.sharers>0 && (*b).second.block.data==ref.block.data) { 
+    (*b).second.sharers++;
+    (*b).second.pincount++;
+  } else {
+    s.detached[ref.block.data].sharers++;
+  }
 }
 
 
-SIZE_T BufferCache::GetBlockSize() const
+void BufferCache::DropSharer(const BlockRef &ref)
 {
-  return disk->GetBlockSize();
+  CacheShard &s=ShardOf(ref.blocknum);
+  CacheGuard g(&(s.lock));
+  BlockTable::iterator b=s.blockmap.find(ref.blocknum);
+
+  if (b!=s.blockmap.end() && (*b).second.sharers>0 && (*b).second.block.data==ref.block.data) { 
+    (*b).second.sharers--;
+    (*b).second.pincount--;
+    return;
+  }
+
+  unordered_map<const BYTE_T *, DetachedBuffer>::iterator d=s.detached.find(ref.block.data);
+
+  if (d==s.detached.end() || --(*d).second.sharers>0) { 
+    return;
+  }
+  if ((*d).second.slot) { 
+    ReleaseSlot(s,(*d).second.slot);
+  } else {
+    delete (*d).second.block;
+  }
+  s.detached.erase(d);
 }
 
-SIZE_T BufferCache::GetNumBlocks() const
+
+BlockRef::BlockRef() : cache(0), blocknum(0), shared(false)
+{}
+
+BlockRef::BlockRef(const BlockRef &rhs) : cache(0), blocknum(0), shared(false)
 {
-  return disk->GetNumBlocks();
+  *this=rhs;
 }
 
-double BufferCache::GetCurrentTime() const
+BlockRef & BlockRef::operator=(const BlockRef &rhs)
 {
-  return curtime;
+  if (this==&rhs) { 
+    return *this;
+  }
+  Release();
+  if (rhs.shared) { 
+    rhs.cache->AddSharer(rhs);
+    block.Borrow(rhs.block.data,rhs.block.length);
+    block.lastaccessed=rhs.block.lastaccessed;
+    block.dirty=rhs.block.dirty;
+  } else if (rhs.cache) { 
+    block=rhs.block;
+  }
+  cache=rhs.cache;
+  blocknum=rhs.blocknum;
+  shared=rhs.shared;
+  return *this;
 }
 
-ERROR_T BufferCache::NotifyAllocateBlock(const SIZE_T outblocknum)
+BlockRef::~BlockRef()
 {
-  allocs++;
-  return disk->NotifyAllocateBlocks(outblocknum,1);
+  Release();
 }
 
-ERROR_T BufferCache::NotifyDeallocateBlock(const SIZE_T inblocknum)
+void BlockRef::Release()
 {
-  deallocs++;
-  return disk->NotifyDeallocateBlocks(inblocknum,1);
+  if (shared) { 
+    cache->DropSharer(*this);
+    block.Borrow(0,0);
+  }
+  cache=0;
+  shared=false;
 }
 
 
-bool  BufferCache::IsBlockAllocated(const SIZE_T inblocknum)
+ERROR_T BufferCache::PinBlock(const SIZE_T inblocknum, Block *&outblock, const AccessHint hint)
 {
-  return disk->IsBlockAllocated(inblocknum);
+  CacheShard &s=ShardOf(inblocknum);
+  CacheGuard g(&(s.lock));
+  BufferFrame *f;
+  ERROR_T rc=FetchFrame(s,inblocknum,f,hint);
+
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+  if (f->sharers>0 && (rc=Unshare(s,*f,true))!=ERROR_NOERROR) { 
+    // the pinner may write
+    return rc;
+  }
+  f->pincount++;
+  outblock=&(f->block);
+  return ERROR_NOERROR;
 }
 
 
-ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock) 
+ERROR_T BufferCache::UnpinBlock(const SIZE_T inblocknum, const bool dirty)
 {
-  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
+  CacheShard &s=ShardOf(inblocknum);
+  CacheGuard g(&(s.lock));
+  BlockTable::iterator b;
 
-  b = blockmap.find(inblocknum);
+  b = s.blockmap.find(inblocknum);
 
-  if (b!=blockmap.end()) {
-    // It's in  cache, just update its lastaccessed and return it
-    outblock=(*b).second;
-    (*b).second.lastaccessed=curtime;
-    reads++;
-    return ERROR_NOERROR;
+  if (b==s.blockmap.end() || (*b).second.pincount==0) { 
+    return ERROR_NOSUCHBLOCK;
+  }
+  (*b).second.pincount--;
+  if (dirty) { 
+    SetDirty((*b).second,true);
+    s.writes++;
+    CountBlock(inblocknum,&BlockStats::writes);
+    return MaybeFlush(s);
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BufferCache::MarkDirty(const SIZE_T inblocknum)
+{
+  CacheShard &s=ShardOf(inblocknum);
+  CacheGuard g(&(s.lock));
+  BlockTable::iterator b;
+
+  b = s.blockmap.find(inblocknum);
+
+  if (b==s.blockmap.end()) { 
+    return ERROR_NOSUCHBLOCK;
+  }
+  SetDirty((*b).second,true);
+  s.writes++;
+  CountBlock(inblocknum,&BlockStats::writes);
+  return MaybeFlush(s);
+}
+
+
+ERROR_T BufferCache::WriteBlock(const SIZE_T inblocknum, const Block &inblock, const AccessHint hint)
+{
+  CacheShard &s=ShardOf(inblocknum);
+  CacheGuard g(&(s.lock));
+  BlockTable::iterator b;
+
+  b = s.blockmap.find(inblocknum);
+
+  if (b!=s.blockmap.end()) {
+    ERROR_T rc;
+    if ((*b).second.sharers>0 && (rc=Unshare(s,(*b).second,false))!=ERROR_NOERROR) { 
+      return rc;
+    }
+    // It's in  cache, so just replace the block, once no read
+    // is still landing in it
+    // Copy into the existing buffer when we can, since the
+    // block may be pinned by someone holding a pointer to it
+    Settle(s,(*b).second);
+    if ((*b).second.block.length==inblock.length) { 
+      memcpy((*b).second.block.data,inblock.data,inblock.length);
+    } else {
+      bool wasdirty=(*b).second.block.dirty;
+      (*b).second.block=inblock;
+      (*b).second.block.dirty=wasdirty;
+    }
+    (*b).second.block.lastaccessed=curtime;
+    if ((*b).second.prefetched) { 
+      // overwritten before it was read, so the prefetch was wasted
+      (*b).second.prefetched=false;
+      (*b).second.readyat=curtime;
+      s.numprefetched--;
+      s.prefetchwaste++;
+    } else if ((*b).second.readahead) { 
+      (*b).second.readahead=false;
+      ShrinkReadAhead(s);
+    } else if ((*b).second.reserved) { 
+      s.reservedframes.MoveToFront(&((*b).second));
+    } else if (!Scanning() && !(*b).second.scan) {
+      s.policy->Touch(&((*b).second));
+    }
+    if ((*b).second.scan && !Scanning()) { 
+      Promote(s,(*b).second);
+    }
+    ApplyHint(s,(*b).second,hint);
+    (*b).second.lastuse=++s.useclock;
+    SetDirty((*b).second,true);
+    s.writes++;
+    CountBlock(inblocknum,&BlockStats::writes);
+    RecordAccess(inblocknum);
+    return MaybeFlush(s);
   } else {
     // It's not in cache, so time to allocate it
-    CheckDeleteOldest();
-    // read it from disk
-    if (!(disk->IsBlockAllocated(inblocknum))) { 
+    double missstart=curtime;
+    ERROR_T rc;
+
+    s.policy->Miss(inblocknum);
+    if ((rc=MakeRoom(s))!=ERROR_NOERROR) { 
+      return rc;
+    }
+    if (!IsBlockAllocated(inblocknum)) {
       if (PRINT_BUFFERCACHE_ALLOCATION_ERRORS) {
-	cerr << "BufferCache::ReadBlock: Attempt to read unallocated block " << inblocknum<<endl;
+	cerr << "BufferCache::WriteBlock: Attempt to write unallocated block " << inblocknum << endl;
       }
     }
-    double reqtime;
-    int rc = disk->Read(inblocknum,
-			outblock,
-			reqtime);
-    curtime+=reqtime;
-    diskreads++;
-    if (rc!=ERROR_NOERROR) { 
-      return rc;
-    } else {
-      outblock.lastaccessed=curtime;
-      outblock.dirty=false;
-      blockmap[inblocknum]=outblock;
-      reads++;
-      return ERROR_NOERROR;
+    if (s.tier) { 
+      // about to be overwritten
+      s.tier->Erase(inblocknum);
     }
+    BufferFrame &f=NewFrame(s,inblocknum);
+    f.block=inblock;
+    f.block.lastaccessed=curtime;
+    f.block.dirty=false;
+    SetDirty(f,true);
+    f.lastuse=++s.useclock;
+    Admit(s,f);
+    ApplyHint(s,f,hint);
+    s.writes++;
+    s.misses++;
+    s.misstime+=curtime-missstart;
+    CountBlock(inblocknum,&BlockStats::writes);
+    CountBlock(inblocknum,&BlockStats::misses);
+    RecordAccess(inblocknum);
+    return MaybeFlush(s);
   }
-} 
- 
-ERROR_T BufferCache::WriteBlock(const SIZE_T inblocknum, const Block &inblock)
+}
+
+ERROR_T BufferCache::PrefetchBlock (const SIZE_T blocknum)
 {
-  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
-  
-  b = blockmap.find(inblocknum);
+  if (blocknum>=disk->GetNumBlocks()) { 
+    return ERROR_NOSUCHBLOCK;
+  }
 
-  if (b!=blockmap.end()) {
-    // It's in  cache, so just replace the block
-    (*b).second=inblock;
-    (*b).second.lastaccessed=curtime;
-    (*b).second.dirty=true;
-    writes++;
+  CacheShard &s=ShardOf(blocknum);
+  CacheGuard g(&(s.lock));
+
+  if (s.blockmap.find(blocknum)!=s.blockmap.end()) { 
+    // already here, or already on its way
     return ERROR_NOERROR;
-  } else {
-    // It's not in cache, so time to allocate it
-    CheckDeleteOldest();
-    if (!(disk->IsBlockAllocated(inblocknum))) { 
-      if (PRINT_BUFFERCACHE_ALLOCATION_ERRORS) {
-	cerr << "BufferCache::WriteBlock: Attempt to write unallocated block " << inblocknum << endl;
-      }
+  }
+
+  if (s.numprefetched>=s.cachesize/4) { 
+    return ERROR_NOFETCH;
+  }
+
+  BufferFrame *victim=0;
+
+  if (s.blockmap.size() >= s.cachesize) {
+    victim=ChooseVictim(s,false);
+
+    // Only a clean block that someone has already used may
+    // be given up for a prefetch
+    if (!victim || victim->block.dirty || victim->prefetched) {
+      return ERROR_NOFETCH;
     }
-    Block myblock=inblock;
-    myblock.lastaccessed=curtime;
-    myblock.dirty=true;
-    blockmap[inblocknum]=myblock;
-    writes++;
+  }
+
+  // The prefetch goes ahead, so only now does the policy hear of
+  // the miss, which for ARC moves its target and its ghosts
+  s.policy->Miss(blocknum);
+
+  if (victim) {
+    Stash(s,*victim);
+    Forget(s,*victim,true);
+    FreeFrame(s,victim->blocknum);
+  }
+
+  BufferFrame &f=NewFrame(s,blocknum);
+  double reqtime;
+  int rc;
+  {
+    CacheGuard d(&disklock);
+    // left in flight until the block is first used
+    rc = disk->SubmitRead(blocknum,
+			  f.block,
+			  reqtime,
+			  f.ioticket);
+    if (rc==ERROR_NOERROR) {
+      f.readyat=ScheduleDisk(reqtime);
+    }
+  }
+  s.diskreads++;
+  if (rc!=ERROR_NOERROR) { 
+    FreeFrame(s,blocknum);
+    return rc;
+  }
+  if (s.tier) { 
+    s.tier->Erase(blocknum);
+  }
+  f.prefetched=true;
+  f.block.lastaccessed=curtime;
+  f.block.dirty=false;
+  f.lastuse=++s.useclock;
+  Admit(s,f);
+  s.prefetches++;
+  s.numprefetched++;
+  return ERROR_NOERROR;
+}
+
+void BufferCache::SetFlushWatermarks(const double high, const double low)
+{
+  for (SIZE_T i=0;i<shards.size();i++) {
+    CacheShard &s=*(shards[i]);
+    CacheGuard g(&(s.lock));
+
+    s.highwater=high;
+    s.lowwater = low<high ? low : high;
+    MaybeFlush(s);
+  }
+}
+
+
+ERROR_T BufferCache::StartFlusher()
+{
+  CacheGuard f(&flushlock);
+
+  if (flusherrunning) { 
     return ERROR_NOERROR;
   }
+  flusherstop=false;
+  flushpending=true;
+  if (pthread_create(&flusher,0,FlusherMain,this)) { 
+    return ERROR_GENERAL;
+  }
+  flusherrunning=true;
+  return ERROR_NOERROR;
 }
-  
-ERROR_T BufferCache::PrefetchBlock (const SIZE_T blocknum)
+
+
+ERROR_T BufferCache::StopFlusher()
 {
-  // Not implemented yet
-  return ERROR_IMPLBUG;
+  {
+    CacheGuard f(&flushlock);
+
+    if (!flusherrunning) { 
+      return ERROR_NOERROR;
+    }
+    flusherstop=true;
+    pthread_cond_signal(&flushwake);
+  }
+  pthread_join(flusher,0);
+
+  CacheGuard f(&flushlock);
+  flusherrunning=false;
+  return ERROR_NOERROR;
 }
-  
+
+
 ERROR_T BufferCache::FlushBlock(const SIZE_T blocknum)
 {
-  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
-  
-  b = blockmap.find(blocknum);
+  CacheShard &s=ShardOf(blocknum);
+  CacheGuard g(&(s.lock));
+  BlockTable::iterator b;
+
+  b = s.blockmap.find(blocknum);
 
-  if (b==blockmap.end()) { 
+  if (b==s.blockmap.end()) { 
     return ERROR_NOERROR;
   } else {
-    if ((*b).second.dirty) { 
+    if ((*b).second.block.dirty) { 
       double reqtime;
       int rc;
-      rc=disk->Write((*b).first,
-		     (*b).second,
-		     reqtime);
-      diskwrites++;
-      curtime+=reqtime;
+      {
+	CacheGuard d(&disklock);
+	rc=disk->Write((*b).first,
+		       (*b).second.block,
+		       reqtime);
+	ChargeDisk(reqtime);
+      }
+      s.diskwrites++;
       if (rc!=ERROR_NOERROR) { 
 	return rc;
       }
     }
-    blockmap.erase(b);
+    SetDirty((*b).second,false);
+    if ((*b).second.pincount==0) { 
+      if ((*b).second.prefetched) { 
+	s.numprefetched--;
+	s.prefetchwaste++;
+      }
+      if ((*b).second.readahead) { 
+	ShrinkReadAhead(s);
+      }
+      Unreserve(s,(*b).second);
+      Forget(s,(*b).second,false);
+      FreeFrame(s,blocknum);
+    }
     return ERROR_NOERROR;
   }
 }
-  
+
 ostream & BufferCache::Print(ostream &os) const
 {
   os << "BufferCache(cachesize="<<cachesize
+     << ", shards="<<shards.size()
+     << ", policy="<<GetPolicyName()
      << ", blocksize="<<GetBlockSize()
      << ", curtime="<<curtime
-     << ", allocs="<<allocs
-     << ", deallocs="<<deallocs
-     << ", reads="<<reads
-     << ", writes="<<writes
-     << ", diskreads="<<diskreads
-     << ", diskwrites="<<diskwrites
+     << ", allocs="<<GetNumAllocs()
+     << ", deallocs="<<GetNumDeallocs()
+     << ", reads="<<GetNumReads()
+     << ", writes="<<GetNumWrites()
+     << ", diskreads="<<GetNumDiskReads()
+     << ", diskwrites="<<GetNumDiskWrites()
+     << ", prefetches="<<GetNumPrefetches()
+     << ", prefetchhits="<<GetNumPrefetchHits()
+     << ", prefetchwaste="<<GetNumPrefetchWaste()
+     << ", readaheads="<<GetNumReadAheads()
+     << ", readaheadblocks="<<GetNumReadAheadBlocks()
+     << ", readaheadhits="<<GetNumReadAheadHits()
+     << ", readaheadwaste="<<GetNumReadAheadWaste()
+     << ", numdirty="<<GetNumDirty()
+     << ", flushes="<<GetNumFlushes()
+     << ", flushedblocks="<<GetNumFlushedBlocks()
+     << ", flusherrors="<<GetNumFlushErrors()
+     << ", scanblocks="<<GetNumScanBlocks()
+     << ", tierhits="<<GetNumTierHits()
      << ", blocks = {";
 
-  
-  for (map<SIZE_T, Block, cache_compare_lessthan>::const_iterator b=blockmap.begin(); 
-       b!=blockmap.end(); 
-       ++b) {
-    if (b!=blockmap.begin()) { 
+  // The table is unordered, so sort the block numbers for display
+  vector<pair<SIZE_T,bool> > nums;
+  SIZE_T i;
+
+  for (i=0;i<shards.size();i++) {
+    pthread_mutex_lock(&(shards[i]->lock));
+  }
+  for (i=0;i<shards.size();i++) {
+    for (BlockTable::const_iterator b=shards[i]->blockmap.begin();
+	 b!=shards[i]->blockmap.end();
+	 ++b) {
+      nums.push_back(pair<SIZE_T,bool>((*b).first,(*b).second.block.dirty));
+    }
+  }
+  sort(nums.begin(),nums.end());
+
+  for (vector<pair<SIZE_T,bool> >::const_iterator n=nums.begin(); n!=nums.end(); ++n) {
+    if (n!=nums.begin()) { 
       os << ", ";
     }
-    os << (*b).first << ((*b).second.dirty ? "(dirty)" : "");
+    os << (*n).first << ((*n).second ? "(dirty)" : "");
+  }
+  {
+    CacheGuard d(&disklock);
+    os << "}, disk="<<*disk<<")";
   }
-  os << "}, disk="<<*disk<<")";
-  
+  for (i=0;i<shards.size();i++) {
+    pthread_mutex_unlock(&(shards[i]->lock));
+  }
+
   return os;
 }
-  
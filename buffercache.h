@@ -2,39 +2,229 @@
 #define _buffercache
 
 #include <iostream>
-#include <map>
+#include <unordered_map>
+#include <vector>
+#include <atomic>
+#include <pthread.h>
 
 #include "global.h"
 #include "block.h"
 #include "disksystem.h"
+#include "replacement.h"
+#include "mrc.h"
+#include "compress.h"
 
 using namespace std;
 
-struct cache_compare_lessthan {
-  bool operator()(const SIZE_T s1, const SIZE_T s2) const {
-    return s1<s2;
-  }
+// Read-ahead windows, in blocks
+const SIZE_T READAHEAD_MIN_WINDOW=4;
+const SIZE_T READAHEAD_MAX_WINDOW=64;
+// Largest forward stride that is recognized as a pattern
+const SIZE_T READAHEAD_MAX_STRIDE=8;
+// Longest run of dirty blocks written back in one request
+const SIZE_T WRITEBACK_MAX_RUN=64;
+// Longest run of missing blocks read in one request by ReadBlocks
+const SIZE_T READBATCH_MAX_RUN=64;
+
+// Longest run of blocks read in one request on a warm start
+const SIZE_T WARMUP_MAX_RUN=64;
+// Default share of the cache kept for the upper levels of an index
+const double UPPER_SHARE=0.5;
+// Share of the cache that blocks read by a scan may hold
+const double SCAN_SHARE=0.125;
+// Blocks are dealt out to shards in stripes of this many, so that
+// runs of consecutive blocks mostly stay within one shard
+const SIZE_T SHARD_STRIPE=16;
+// Huge page size assumed for the frame arena
+const SIZE_T ARENA_HUGE_PAGE=2*1024*1024;
+// Reads and writes between looks at the hit rate by AutoTune
+const SIZE_T AUTOTUNE_PERIOD=1000;
+// Share of the cache size by which AutoTune grows or shrinks it
+const double AUTOTUNE_STEP=0.125;
+// How far the hit rate must be above target before AutoTune shrinks
+const double AUTOTUNE_SLACK=0.02;
+
+// Pages behind the frame arena
+enum ArenaPageType {ARENA_PAGES_NORMAL, ARENA_PAGES_THP, ARENA_PAGES_HUGE};
+
+
+//
+// What happened to one block, when block statistics are on
+//
+struct BlockStats {
+  SIZE_T reads, writes, misses, evictions;
+
+  BlockStats() : reads(0), writes(0), misses(0), evictions(0) {}
+};
+
+
+//
+// A buffer that a write took away from its frame while BlockRefs
+// still held it.  It is freed, or its slot given back to the
+// arena, when the last of them lets go.
+//
+struct DetachedBuffer {
+  SIZE_T sharers;
+  BYTE_T *slot;                 // arena slot, or
+  Block  *block;                // the block that owns the buffer
+};
+
+
+//
+// One shard of the cache: a slice of the block table with its own
+// replacement policy, lock, and counters.  Everything in a shard is
+// protected by its lock.
+//
+struct CacheShard {
+  SIZE_T cachesize;
+  unordered_map<SIZE_T, BufferFrame, cache_hash> blockmap;
+  ReplacementPolicy *policy;
+  pthread_mutex_t lock;
+  SIZE_T reads, writes, diskreads, diskwrites;
+  SIZE_T prefetches, prefetchhits, prefetchwaste, numprefetched;
+  bool   readahead;
+  SIZE_T lastaccess, rastride, rawindow, rawindowsize, rawindowhits;
+  SIZE_T readaheads, readaheadblocks, readaheadhits, readaheadwaste;
+  SIZE_T numdirty;
+  double highwater, lowwater;
+  SIZE_T flushes, flushedblocks, flusherrors;
+  double flushtime;
+  SIZE_T dirtyclock;
+  SIZE_T useclock;
+  SIZE_T misses;
+  double misstime;
+  SIZE_T reservesize, numreserved;
+  FrameList reservedframes;     // off the policy while reserved
+  FrameList probation;
+  SIZE_T probationsize;
+  SIZE_T scanblocks, scanpromotions;
+  CompressedTier *tier;
+  SIZE_T tierlookups, tierhits, tierstores;
+  SIZE_T tierrawbytes, tierstoredbytes;
+  double tiercputime;
+  vector<BYTE_T *> freeslots;
+  SIZE_T arenaoverflows;
+  SIZE_T numslots;              // arena slots dealt to the shard
+  unordered_map<const BYTE_T *, DetachedBuffer> detached;
+  SIZE_T sharedreads, privatereads, unshares;
+  SIZE_T resizeevictions;
+  SIZE_T batchmisses, batchruns;
 };
 
 
+class BlockRef;
+
+
 //
-// LRU block cache with single step prefetch
+// Block cache with a pluggable replacement policy
 //
 // Write Back
 // Write Allocate
+//
+// The block table is a hash map of frames, and the policy threads
+// its lists through the frames themselves, so touching and evicting
+// a block do not depend on the cache size.
+//
+// The cache is safe to use from many threads.  The table is split
+// into shards by block number, each with its own lock, so threads
+// working on different shards do not wait for each other.  The
+// disk, the simulated clock and the allocation counters sit behind
+// a separate disk lock, which is only taken inside a shard lock,
+// as is the lock of the miss ratio curve.  The flusher thread alone
+// keeps the disk lock after letting go of the shard lock, while it
+// writes, and takes no shard lock until it is done.
+// A thread never holds two shard locks, except for Attach, Detach
+// and Print, which take all of them in order.
+//
 class BufferCache {
  private:
   DiskSystem *disk;
   SIZE_T cachesize;
-  map<SIZE_T, Block, cache_compare_lessthan> blockmap;
-  double curtime;
-  SIZE_T allocs, deallocs, reads, writes, diskreads, diskwrites;
+  vector<CacheShard *> shards;
+  mutable pthread_mutex_t disklock;
+  atomic<double> curtime;
+  double diskfree;
+  SIZE_T allocs, deallocs;
+  pthread_mutex_t flushlock;
+  pthread_cond_t  flushwake;
+  pthread_t       flusher;
+  bool            flusherrunning, flusherstop, flushpending;
+  string manifest;
+  bool   attached;
+  SIZE_T warmblocks;
+  double warmuptime;
+  MissRatioCurve *mrc;
+  mutable pthread_mutex_t mrclock;
+  ArenaPageType arenapages, arenamapped;
+  void   *arenabase;
+  size_t  arenalen;
+  // Regions mapped when the cache grew, and slots of the arena
+  // that no shard needs since it shrank
+  vector<pair<void *, size_t> > arenagrowth;
+  vector<BYTE_T *> spareslots;
+  pthread_mutex_t  sparelock;
+  double uppershare;
+  SIZE_T resizes;
+  double tunetarget;
+  SIZE_T tunemaxbytes;
+  SIZE_T tuneaccesses, tunemisses;
+  // One per block of the disk.  An entry is only touched under
+  // the lock of the shard its block belongs to.
+  vector<BlockStats> blockstats;
+
+  static void *FlusherMain(void *cache);
+  template <class T> T Sum(T CacheShard::*counter) const;
  protected:
-  ERROR_T CheckDeleteOldest();
+  SIZE_T  ShardIndex(const SIZE_T blocknum) const;
+  CacheShard &ShardOf(const SIZE_T blocknum) const;
+  void    SetDirty(BufferFrame &f, const bool dirty);
+  bool    OverHighWater(const CacheShard &s) const;
+  void    FlushCandidates(CacheShard &s, vector<BufferFrame *> &frames);
+  ERROR_T Flush(CacheShard &s);
+  ERROR_T BackgroundFlush(CacheShard &s);
+  ERROR_T MaybeFlush(CacheShard &s);
+  SIZE_T  ReadAheadWindow(CacheShard &s, const SIZE_T inblocknum);
+  void    ResetReadAhead(CacheShard &s);
+  void    ShrinkReadAhead(CacheShard &s);
+  ERROR_T InstallReadAhead(CacheShard &s, const SIZE_T blocknum, const Block &block, const double readyat);
+  void    ApplyHint(CacheShard &s, BufferFrame &f, const AccessHint hint);
+  void    Unreserve(CacheShard &s, BufferFrame &f);
+  void    Admit(CacheShard &s, BufferFrame &f);
+  void    Promote(CacheShard &s, BufferFrame &f);
+  void    Forget(CacheShard &s, BufferFrame &f, const bool evicted);
+  BufferFrame *ChooseVictim(CacheShard &s, const bool clean);
+  void    Stash(CacheShard &s, BufferFrame &f);
+  bool    Unstash(CacheShard &s, const SIZE_T blocknum, Block &block);
+  BufferFrame &NewFrame(CacheShard &s, const SIZE_T blocknum);
+  void    FreeFrame(CacheShard &s, const SIZE_T blocknum);
+  ERROR_T MapArena();
+  void    UnmapArena();
+  ERROR_T GrowArena();
+  void    ReleaseSlot(CacheShard &s, BYTE_T *slot);
+  void    ApplyUpperShare(CacheShard &s);
+  ERROR_T Unshare(CacheShard &s, BufferFrame &f, const bool copy);
+  void    AddSharer(const BlockRef &ref);
+  void    DropSharer(const BlockRef &ref);
+  friend class BlockRef;
+  ERROR_T Settle(CacheShard &s, BufferFrame &f);
+  // These two are called with the disk lock held
+  void    ChargeDisk(const double reqtime);
+  double  ScheduleDisk(const double reqtime);
+  void    WaitUntil(const double readyat);
+  void    RecordAccess(const SIZE_T blocknum);
+  void    CountBlock(const SIZE_T blocknum, SIZE_T BlockStats::*counter);
+  ERROR_T WriteBack(vector<BufferFrame *> &frames, const bool background=false);
+  ERROR_T MakeRoom(CacheShard &s, const SIZE_T room=1);
+  ERROR_T FetchFrame(CacheShard &s, const SIZE_T inblocknum, BufferFrame *&outframe,
+		     const AccessHint hint);
+  ERROR_T LoadManifest();
+  ERROR_T SaveManifest();
  public:
-  // Cache size is in number of blocks
+  // Cache size is in number of blocks, split evenly over the shards
   BufferCache(DiskSystem *disk,
-	      const SIZE_T cachesize);
+	      const SIZE_T cachesize,
+	      const ReplacementPolicyType policy=POLICY_LRU,
+	      const SIZE_T numshards=1);
   BufferCache() { throw 0; }
   BufferCache(const BufferCache &rhs) { throw 0; } 
   BufferCache & operator=(const BufferCache &rhs) { throw 0; return *this; } 
@@ -45,8 +235,111 @@ class BufferCache {
   ERROR_T Attach();
   ERROR_T Detach();
 
+  // Warm restart
+  //
+  // With a manifest file set, Detach records the resident block
+  // numbers, most recently used first, and Attach reads them back
+  // in.  The blocks are read in sorted order, one request per run
+  // of consecutive blocks, and given to the policy oldest first so
+  // that their recency order carries over.  A missing manifest
+  // just means a cold start.  GetWarmupTime is the simulated time
+  // that Attach spent loading.  If the manifest cannot be written,
+  // Detach still writes back and empties the cache, and returns
+  // ERROR_NOFILE.
+  void   SetManifest(const string &filename) { manifest=filename; }
+  SIZE_T GetNumWarmBlocks() const { return warmblocks; }
+  double GetWarmupTime() const { return warmuptime; }
+
+  // Frame arena
+  //
+  // Attach maps one region of cachesize blocks, and each shard
+  // deals its frames their data from its slice of it, so cached
+  // blocks are not allocated one by one.  SetCacheSize maps more
+  // as the cache grows.  A shard that runs over
+  // size because every frame is pinned gives the extra frames
+  // buffers of their own, counted by GetNumArenaOverflows.
+  // SetArenaPages, called before Attach, asks for transparent huge
+  // pages (madvise) or explicit ones (MAP_HUGETLB, which needs
+  // pages reserved in vm.nr_hugepages).  When they cannot be had,
+  // the arena falls back to smaller pages, and GetArenaPages says
+  // what it got.
+  void   SetArenaPages(const ArenaPageType pages) { arenapages=pages; }
+  ArenaPageType GetArenaPages() const { return arenamapped; }
+  SIZE_T GetNumArenaOverflows() const { return Sum(&CacheShard::arenaoverflows);}
+
+  // Block statistics
+  //
+  // With block statistics on, the cache counts the reads, writes,
+  // misses and evictions of each block of the disk, so that hot
+  // blocks, and blocks that are evicted and read back over and
+  // over, can be picked out.  The counts are those of the cache
+  // totals, split by block.  Turning them on, which should be done
+  // before Attach, clears them.
+  void    SetBlockStats(const bool enable);
+  bool    HasBlockStats() const { return !blockstats.empty(); }
+  // returns one of ERROR_NOERROR (zero)
+  // ERROR_NOSUCHBLOCK if the block is not on the disk or
+  // statistics are off
+  ERROR_T GetBlockStats(const SIZE_T blocknum, BlockStats &stats) const;
+
+  // Cache sizing
+  //
+  // With a sample rate set, every demand read, pin and write is fed
+  // to a MissRatioCurve, from which the miss ratio of an LRU cache
+  // of any other size can be read off after a single run.  The
+  // disk time estimate prices each miss at the average simulated
+  // time, write-backs included, that the misses of this run cost.
+  // Call before Attach; a rate of zero, the default, turns it off.
+  void   SetMissRatioSampling(const double samplerate);
+  bool   HasMissRatioCurve() const { return mrc!=0; }
+  double GetEstimatedMissRatio(const SIZE_T cachesize) const;
+  double GetEstimatedDiskTime(const SIZE_T cachesize) const;
+  SIZE_T GetEstimatedFootprint() const;
+
+  // Resizing
+  //
+  // SetCacheSize changes the number of blocks in the cache, at any
+  // time, split over the shards as the constructor does.  Growing
+  // takes effect at once, the new frames taking their data from
+  // arena slots given up by an earlier shrink or else from a newly
+  // mapped region.  Shrinking evicts through the replacement policy,
+  // writing back dirty victims on the simulated disk as any miss
+  // would, and gives back to the system the pages of the slots that
+  // are no longer needed when blocks are at least a page long.
+  // Pinned and shared blocks are kept, the shard running over size
+  // until they are let go.  Counters and the simulated clock carry
+  // on across a resize.
+  //
+  // returns one of ERROR_NOERROR (zero)
+  // ERROR_SIZE if there would be fewer blocks than shards,
+  // ERROR_NOMEM if a larger arena cannot be mapped, in which case
+  // the cache still grows but new frames use buffers of their own,
+  // or an error from writing back
+  ERROR_T SetCacheSize(const SIZE_T cachesize);
+  SIZE_T  GetNumResizes() const { return resizes; }
+  SIZE_T  GetNumResizeEvictions() const { return Sum(&CacheShard::resizeevictions);}
+
+  // Auto-tuning
+  //
+  // SetAutoTune gives a target hit rate, from 0 to 1, and a cap on
+  // the bytes of cached blocks, zero for no cap.  Calls to AutoTune,
+  // made between operations, resize the cache once every
+  // AUTOTUNE_PERIOD reads and writes.  With a miss ratio curve the
+  // cache goes straight to the smallest size estimated to reach
+  // the target.  Without one it grows by AUTOTUNE_STEP of its size
+  // when the hit rate since the last look was below target, and
+  // shrinks by as much when it was more than AUTOTUNE_SLACK above.
+  // The size never goes over the cap, and a target of zero only
+  // enforces the cap.  A hit is a read or write that did not miss.
+  //
+  // returns what SetCacheSize does, or ERROR_NOERROR if the size
+  // stays the same
+  void    SetAutoTune(const double targethitrate, const SIZE_T maxbytes=0);
+  ERROR_T AutoTune();
+
   // Number of blocks in the cache
   SIZE_T GetCacheSize() const;
+  SIZE_T GetNumShards() const { return shards.size(); }
   // Number of bytes per block
   SIZE_T GetBlockSize() const;
   // Number of blocks in the underlying device
@@ -64,30 +357,195 @@ class BufferCache {
   
   // returns one of ERROR_NOERROR  (zero)
   // ERROR_NOSUCHBLOCK or other nonzero error codes
-  ERROR_T ReadBlock(const SIZE_T inblocknum, Block &outblock);
+  ERROR_T ReadBlock(const SIZE_T inblocknum, Block &outblock, 
+		    const AccessHint hint=HINT_NONE);
+
+  // Batched reads
+  //
+  // ReadBlocks reads a list of blocks into outblocks, in the same
+  // order, as ReadBlock would one at a time, but the blocks that
+  // miss are read in elevator order from where the disk head is,
+  // and runs of consecutive ones in one request each, instead of
+  // in the order given.  The hint applies to all of them.  A block
+  // may appear more than once.  On an error, the blocks already
+  // read stay in the cache and outblocks is partly filled.
+  //
+  // returns one of ERROR_NOERROR  (zero)
+  // ERROR_NOSUCHBLOCK or other nonzero error codes
+  ERROR_T ReadBlocks(const vector<SIZE_T> &blocknums, vector<Block> &outblocks,
+		     const AccessHint hint=HINT_NONE);
+  // Blocks that missed in ReadBlocks, and disk requests it made
+  SIZE_T  GetNumBatchMisses() const { return Sum(&CacheShard::batchmisses);}
+  SIZE_T  GetNumBatchRuns() const { return Sum(&CacheShard::batchruns);}
+
+  // Read without a copy
+  //
+  // This ReadBlock hands back a BlockRef that shares the cached
+  // bytes instead of copying them.  Like a pin, it keeps the block
+  // in the cache until it is released.  A write to the block while
+  // BlockRefs hold it, through WriteBlock or a PinBlock taken
+  // afterwards, first moves the cache to a copy of its own, so the
+  // BlockRefs go on seeing the bytes they were given.  A block
+  // already pinned, which may be written in place, is copied into
+  // the BlockRef instead of shared.  Release every BlockRef before
+  // Detach.
+  //
+  // returns one of ERROR_NOERROR  (zero)
+  // ERROR_NOSUCHBLOCK or other nonzero error codes
+  ERROR_T ReadBlock(const SIZE_T inblocknum, BlockRef &outref,
+		    const AccessHint hint=HINT_NONE);
+  // Reads served by sharing, and by a private copy
+  SIZE_T  GetNumSharedReads() const { return Sum(&CacheShard::sharedreads);}
+  SIZE_T  GetNumPrivateReads() const { return Sum(&CacheShard::privatereads);}
+  // Writes that had to leave a block's bytes to its BlockRefs
+  SIZE_T  GetNumUnshares() const { return Sum(&CacheShard::unshares);}
   
   // returns one of ERROR_NOERROR  (zero)
   // ERROR_NOSUCHBLOCK
   // ERROR_WRONGSIZEBLOCK or other nonzero error codes
-  ERROR_T WriteBlock(const SIZE_T inblocknum, const Block &inblock);
+  ERROR_T WriteBlock(const SIZE_T inblocknum, const Block &inblock, 
+		     const AccessHint hint=HINT_NONE);
+
+  // Access hints
+  //
+  // A hint says what a block holds.  Reads, writes and pins take
+  // one, and SetBlockHint gives one to a resident block once its
+  // contents are known, as when a node has just been read.
+  // HINT_NONE leaves the previous hint in place.  Superblocks,
+  // roots and interior nodes are kept out of the replacement
+  // policy's reach for up to the upper share of the cache, the
+  // first ones accessed getting the slots.  The rest of the cache,
+  // and upper level blocks beyond the share, are managed by the
+  // policy as usual.  SetUpperShare(0) turns this off.
+  //
+  // SetBlockHint returns ERROR_NOSUCHBLOCK if the block is not in
+  // the cache.
+  ERROR_T SetBlockHint(const SIZE_T inblocknum, const AccessHint hint);
+  void    SetUpperShare(const double share);
+  SIZE_T  GetNumReserved() const { return Sum(&CacheShard::numreserved);}
+
+  // Scans
+  //
+  // Between BeginScan and EndScan, blocks the calling thread reads
+  // that are not already cached go on a small probation list,
+  // holding at most SCAN_SHARE of each shard, instead of to the
+  // replacement policy.  Scanned blocks are the first to be evicted,
+  // and neither a hit by the scan nor read-ahead moves them or any
+  // other block up.  A later access outside a scan hands the block
+  // to the policy as if it had just been read.  So a walk over the
+  // whole tree displaces only a few blocks of the working set.
+  // Scans nest.
+  void    BeginScan();
+  void    EndScan();
+  SIZE_T  GetNumScanBlocks() const { return Sum(&CacheShard::scanblocks);}
+  SIZE_T  GetNumScanPromotions() const { return Sum(&CacheShard::scanpromotions);}
+
+  // Compressed second tier
+  //
+  // With a tier set, clean blocks evicted from the cache are kept
+  // in memory, compressed with LZCompress, within a budget of the
+  // given number of uncompressed blocks' worth of bytes, split over
+  // the shards.  A miss that finds its block there decompresses it
+  // instead of reading the disk, and the block leaves the tier.
+  // Blocks evicted by a scan are not kept.  Tier hits cost no
+  // simulated time; GetTierCPUTime is the real CPU time, in
+  // seconds, spent compressing and decompressing.  Zero blocks, the
+  // default, turns the tier off and drops what it holds.
+  void    SetCompressedTier(const SIZE_T blocks);
+  bool    HasCompressedTier() const { return shards[0]->tier!=0; }
+  SIZE_T  GetNumTierLookups() const { return Sum(&CacheShard::tierlookups);}
+  SIZE_T  GetNumTierHits() const { return Sum(&CacheShard::tierhits);}
+  SIZE_T  GetNumTierStores() const { return Sum(&CacheShard::tierstores);}
+  // Bytes before and after compression, over all stores
+  SIZE_T  GetTierRawBytes() const { return Sum(&CacheShard::tierrawbytes);}
+  SIZE_T  GetTierStoredBytes() const { return Sum(&CacheShard::tierstoredbytes);}
+  double  GetTierCPUTime() const { return Sum(&CacheShard::tiercputime);}
+  SIZE_T  GetNumTierBlocks() const;
+
+  // Zero copy access to a cached block
+  //
+  // PinBlock returns a pointer to the cached copy of the block.
+  // The pointer stays valid, and the block stays in the cache,
+  // until a matching UnpinBlock.  Pins nest.  Changes made through
+  // the pointer must be reported with MarkDirty, or with dirty=true
+  // on the unpin, so that they are written back.
+  //
+  // returns one of ERROR_NOERROR (zero)
+  // ERROR_NOSUCHBLOCK if the block is not pinned (UnpinBlock) or
+  // not in the cache (MarkDirty), or other nonzero error codes
+  ERROR_T PinBlock(const SIZE_T inblocknum, Block *&outblock, 
+		   const AccessHint hint=HINT_NONE);
+  ERROR_T UnpinBlock(const SIZE_T inblocknum, const bool dirty=false);
+  ERROR_T MarkDirty(const SIZE_T inblocknum);
   
   // Request that a block be read into the cache
   // This returns immediately.
   // ERROR_NOFETCH means that there is no room currently
   // to prefetch the block and it was not prefetched.
+  //
+  // The read is queued on the disk behind any outstanding work
+  // and the simulated clock does not advance.  A later read of
+  // the block waits only for whatever part of the read is still
+  // outstanding at that time.  Prefetching never writes back a
+  // dirty block to make room, and never lets unread prefetched
+  // blocks take more than a quarter of the cache.
   ERROR_T PrefetchBlock (const SIZE_T blocknum);
   
+  // Read-ahead is on by default.  When a run of misses has a
+  // constant small forward stride, misses also bring in a window
+  // of blocks further along the run, using a single multi-block
+  // disk request when the stride is one.
+  void SetReadAhead(const bool enable);
+
+  // Background flushing
+  //
+  // Once more than the high watermark fraction of a shard is
+  // dirty, dirty unpinned blocks are written back in elevator order
+  // until no more than the low watermark is dirty.  The writes are
+  // queued on the disk like prefetches, so the simulated clock does
+  // not wait for them, and eviction then prefers clean blocks so
+  // that a miss does not have to write one.  A high watermark of
+  // zero, the default, turns flushing off.
+  //
+  // By default flushing is done at the end of the operation that
+  // crosses the high watermark.  StartFlusher moves it to its own
+  // thread, which is what a real I/O backend wants.  The thread
+  // copies the blocks and lets go of the shard while they are
+  // written, so hits on the shard do not wait for the disk.  A
+  // failed write leaves the blocks dirty and is counted.  Detach
+  // stops the thread.
+  void    SetFlushWatermarks(const double high, const double low);
+  ERROR_T StartFlusher();
+  ERROR_T StopFlusher();
+
   // Request that a block be flushed to disk
   // Note that this blocks until the block is finished.
+  // A pinned block is written but stays in the cache.
   ERROR_T FlushBlock(const SIZE_T blocknum);
   
  
-  SIZE_T GetNumAllocs() const { return allocs; }
-  SIZE_T GetNumDeallocs() const { return deallocs; }
-  SIZE_T GetNumReads() const { return reads;}
-  SIZE_T GetNumWrites() const { return writes;}
-  SIZE_T GetNumDiskReads() const { return diskreads;}
-  SIZE_T GetNumDiskWrites() const { return diskwrites;}
+  // Totals over all shards
+  SIZE_T GetNumAllocs() const;
+  SIZE_T GetNumDeallocs() const;
+  SIZE_T GetNumReads() const { return Sum(&CacheShard::reads);}
+  SIZE_T GetNumWrites() const { return Sum(&CacheShard::writes);}
+  SIZE_T GetNumDiskReads() const { return Sum(&CacheShard::diskreads);}
+  SIZE_T GetNumDiskWrites() const { return Sum(&CacheShard::diskwrites);}
+  SIZE_T GetNumPrefetches() const { return Sum(&CacheShard::prefetches);}
+  SIZE_T GetNumPrefetchHits() const { return Sum(&CacheShard::prefetchhits);}
+  SIZE_T GetNumPrefetchWaste() const { return Sum(&CacheShard::prefetchwaste);}
+  SIZE_T GetNumReadAheads() const { return Sum(&CacheShard::readaheads);}
+  SIZE_T GetNumReadAheadBlocks() const { return Sum(&CacheShard::readaheadblocks);}
+  SIZE_T GetNumReadAheadHits() const { return Sum(&CacheShard::readaheadhits);}
+  SIZE_T GetNumReadAheadWaste() const { return Sum(&CacheShard::readaheadwaste);}
+  SIZE_T GetNumDirty() const { return Sum(&CacheShard::numdirty);}
+  SIZE_T GetNumFlushes() const { return Sum(&CacheShard::flushes);}
+  SIZE_T GetNumFlushedBlocks() const { return Sum(&CacheShard::flushedblocks);}
+  SIZE_T GetNumFlushErrors() const { return Sum(&CacheShard::flusherrors);}
+  double GetFlushTime() const { return Sum(&CacheShard::flushtime);}
+  SIZE_T GetNumMisses() const { return Sum(&CacheShard::misses);}
+  double GetMissTime() const { return Sum(&CacheShard::misstime);}
+  const char *GetPolicyName() const { return shards[0]->policy->GetName(); }
 
   ostream & Print(ostream &os) const;
   
@@ -97,4 +555,46 @@ class BufferCache {
 inline ostream & operator<< (ostream &os, const BufferCache &b) { return b.Print(os);}
 
 
+//
+// Read-only handle on a cached block, from BufferCache::ReadBlock.
+// Copying the handle adds another reference to the same bytes.
+//
+class BlockRef {
+ private:
+  BufferCache *cache;
+  SIZE_T       blocknum;
+  Block        block;           // borrows the shared bytes, or owns a copy
+  bool         shared;
+  friend class BufferCache;
+ public:
+  BlockRef();
+  BlockRef(const BlockRef &rhs);
+  BlockRef & operator=(const BlockRef &rhs);
+  ~BlockRef();
+
+  // Let go of the block, leaving the handle empty
+  void    Release();
+  bool    IsEmpty() const { return cache==0; }
+  // Whether the bytes are the cache's rather than a private copy
+  bool    IsShared() const { return shared; }
+  SIZE_T  GetBlockNum() const { return blocknum; }
+
+  const Block & operator*() const { return block; }
+  const Block * operator->() const { return &block; }
+};
+
+
+template <class T> T BufferCache::Sum(T CacheShard::*counter) const
+{
+  T total=0;
+
+  for (SIZE_T i=0;i<shards.size();i++) { 
+    pthread_mutex_lock(&(shards[i]->lock));
+    total+=shards[i]->*counter;
+    pthread_mutex_unlock(&(shards[i]->lock));
+  }
+  return total;
+}
+
+
 #endif
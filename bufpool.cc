@@ -0,0 +1,221 @@
+#include <new>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <stddef.h>
+
+#include "bufpool.h"
+
+const SIZE_T BUFPOOL_MAX_CLASSES=32;
+const SIZE_T BUFPOOL_NO_CLASS=(SIZE_T)-1;
+
+
+// Ahead of each buffer, padded so that the buffer is as aligned
+// as one from new
+union BufferHeader {
+  struct {
+    SIZE_T size;        // bytes after the header
+    SIZE_T sizeclass;   // BUFPOOL_NO_CLASS if too big for any
+    BYTE_T *base;       // what new gave, for delete
+  } h;
+  max_align_t align;
+};
+
+
+// The classes only change when a disk is opened, before other
+// threads use the pool
+static SIZE_T classsize[BUFPOOL_MAX_CLASSES];
+static SIZE_T numclasses=0;
+static SIZE_T poolblocksize=0;
+static SIZE_T poolalign=0;
+
+
+struct ThreadPool {
+  BufferHeader   *free[BUFPOOL_MAX_CLASSES][BUFPOOL_MAX_FREE];
+  SIZE_T         numfree[BUFPOOL_MAX_CLASSES];
+  // only written by the owning thread
+  atomic<SIZE_T> hits;
+  atomic<SIZE_T> misses;
+
+  ThreadPool();
+  ~ThreadPool();
+};
+
+static mutex           poolslock;
+static set<ThreadPool *> pools;
+static SIZE_T          retiredhits=0;
+static SIZE_T          retiredmisses=0;
+
+static thread_local ThreadPool local;
+// Set once local is gone at thread exit, after which the heap
+// is used directly
+static thread_local bool localdead=false;
+
+
+ThreadPool::ThreadPool() : hits(0), misses(0)
+{
+  for (SIZE_T c=0;c<BUFPOOL_MAX_CLASSES;c++) {
+    numfree[c]=0;
+  }
+  lock_guard<mutex> g(poolslock);
+  pools.insert(this);
+}
+
+static void Free(BufferHeader *b)
+{
+  delete [] b->h.base;
+}
+
+ThreadPool::~ThreadPool()
+{
+  for (SIZE_T c=0;c<BUFPOOL_MAX_CLASSES;c++) {
+    for (SIZE_T i=0;i<numfree[c];i++) {
+      Free(free[c][i]);
+    }
+    numfree[c]=0;
+  }
+  localdead=true;
+
+  lock_guard<mutex> g(poolslock);
+  retiredhits+=hits.load(memory_order_relaxed);
+  retiredmisses+=misses.load(memory_order_relaxed);
+  pools.erase(this);
+}
+
+
+static void Count(atomic<SIZE_T> &c)
+{
+  c.store(c.load(memory_order_relaxed)+1,memory_order_relaxed);
+}
+
+// The alignment a buffer of that many bytes needs, or 0
+static SIZE_T AlignOf(const SIZE_T bytes)
+{
+  return poolalign>0 && bytes>=poolalign ? poolalign : 0;
+}
+
+static bool Aligned(const BufferHeader *b, const SIZE_T align)
+{
+  return align==0 || (size_t)(b+1)%align==0;
+}
+
+static SIZE_T ClassOf(const SIZE_T size)
+{
+  for (SIZE_T c=0;c<numclasses;c++) {
+    if (size<=classsize[c]) {
+      return c;
+    }
+  }
+  return BUFPOOL_NO_CLASS;
+}
+
+
+void BufferPool::SetBlockSize(const SIZE_T blocksize)
+{
+  numclasses=0;
+  for (SIZE_T s=BUFPOOL_MIN_CLASS;s<blocksize && numclasses<BUFPOOL_MAX_CLASSES-1;s*=2) {
+    classsize[numclasses++]=s;
+  }
+  classsize[numclasses++]=blocksize;
+  poolblocksize=blocksize;
+}
+
+SIZE_T BufferPool::GetBlockSize()
+{
+  return poolblocksize;
+}
+
+void BufferPool::SetAlignment(const SIZE_T align)
+{
+  poolalign = align>alignof(BufferHeader) ? align : 0;
+}
+
+SIZE_T BufferPool::GetAlignment()
+{
+  return poolalign;
+}
+
+
+BYTE_T *BufferPool::Get(SIZE_T &size)
+{
+  SIZE_T c=ClassOf(size);
+  SIZE_T bytes = c==BUFPOOL_NO_CLASS ? size : classsize[c];
+  SIZE_T align = AlignOf(bytes);
+  BufferHeader *b;
+
+  if (c!=BUFPOOL_NO_CLASS && !localdead) {
+    ThreadPool &p=local;
+    while (p.numfree[c]>0) {
+      b=p.free[c][--p.numfree[c]];
+      if (b->h.size==bytes && Aligned(b,align)) {
+	Count(p.hits);
+	size=bytes;
+	return (BYTE_T *)(b+1);
+      }
+      // left from classes or an alignment since replaced
+      Free(b);
+    }
+  }
+  if (!localdead) {
+    Count(local.misses);
+  }
+
+  BYTE_T *base=new (nothrow) BYTE_T [sizeof(BufferHeader)+bytes+align];
+  if (!base) {
+    size=0;
+    return 0;
+  }
+  BYTE_T *data=base+sizeof(BufferHeader);
+  if (align) {
+    data+=(align-(size_t)data%align)%align;
+  }
+  b=((BufferHeader *)data)-1;
+  b->h.base=base;
+  b->h.size=bytes;
+  b->h.sizeclass=c;
+  size=bytes;
+  return (BYTE_T *)(b+1);
+}
+
+
+void BufferPool::Put(BYTE_T *buf)
+{
+  if (!buf) {
+    return;
+  }
+
+  BufferHeader *b=((BufferHeader *)buf)-1;
+  SIZE_T c=b->h.sizeclass;
+
+  if (c<numclasses && classsize[c]==b->h.size && !localdead) {
+    ThreadPool &p=local;
+    if (p.numfree[c]<BUFPOOL_MAX_FREE) {
+      p.free[c][p.numfree[c]++]=b;
+      return;
+    }
+  }
+  Free(b);
+}
+
+
+SIZE_T BufferPool::GetNumHits()
+{
+  lock_guard<mutex> g(poolslock);
+  SIZE_T n=retiredhits;
+
+  for (set<ThreadPool *>::const_iterator i=pools.begin();i!=pools.end();++i) {
+    n+=(*i)->hits.load(memory_order_relaxed);
+  }
+  return n;
+}
+
+SIZE_T BufferPool::GetNumMisses()
+{
+  lock_guard<mutex> g(poolslock);
+  SIZE_T n=retiredmisses;
+
+  for (set<ThreadPool *>::const_iterator i=pools.begin();i!=pools.end();++i) {
+    n+=(*i)->misses.load(memory_order_relaxed);
+  }
+  return n;
+}
@@ -0,0 +1,52 @@
+#ifndef _bufpool
+#define _bufpool
+
+#include "global.h"
+
+using namespace std;
+
+
+//
+// Recycles the heap buffers of Blocks and BTreeNodes.  Sizes are
+// rounded up to a class: powers of two from BUFPOOL_MIN_CLASS up to
+// the disk's block size, and the block size itself, so that node
+// data and whole blocks share one class and keys the small ones.
+// Each thread keeps its own free list of each class, up to
+// BUFPOOL_MAX_FREE buffers, and takes no lock to use them.  Larger
+// requests, and buffers freed while their class is full, go to the
+// heap.  A buffer may be freed by a thread other than the one that
+// got it.  With an alignment set, as for direct I/O, buffers at
+// least that large start on a multiple of it.
+//
+#ifndef BUFPOOL_MIN_CLASS
+#define BUFPOOL_MIN_CLASS 64
+#endif
+#ifndef BUFPOOL_MAX_FREE
+#define BUFPOOL_MAX_FREE 64
+#endif
+
+class BufferPool {
+ public:
+  // Sets the classes.  Buffers of the old ones are freed as they
+  // come back.
+  static void    SetBlockSize(const SIZE_T blocksize);
+  static SIZE_T  GetBlockSize();
+  // align is a power of two, or 0 for none.  Buffers already free
+  // that do not meet it are not handed out again.
+  static void    SetAlignment(const SIZE_T align);
+  static SIZE_T  GetAlignment();
+
+  // Returns a buffer of at least size bytes, and sets size to
+  // the bytes it really has, or 0 if there is no memory
+  static BYTE_T *Get(SIZE_T &size);
+  // buf must have come from Get, or be 0
+  static void    Put(BYTE_T *buf);
+
+  // Totals over all threads.  A hit is a Get served from a free
+  // list, a miss one that went to the heap.
+  static SIZE_T  GetNumHits();
+  static SIZE_T  GetNumMisses();
+};
+
+
+#endif
@@ -0,0 +1,299 @@
+#include <string>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "buffercache.h"
+
+
+void usage()
+{
+  cerr << "usage: cachebench filestem maxcachesize missespersize\n";
+  cerr << "       cachebench -t maxthreads [-s shards] filestem cachesize opsperthread\n";
+  cerr << "       cachebench -b batchsize filestem cachesize numbatches\n";
+}
+
+static double walltime()
+{
+  struct timeval tv;
+  gettimeofday(&tv,0);
+  return tv.tv_sec*1e6 + tv.tv_usec;
+}
+
+
+//
+// Measures the cost of a cache miss as the cache grows.
+// For each cache size, the cache is filled, and then blocks are
+// read in a cycle one longer than the cache, so that every timed
+// read misses and evicts the least recently used block.
+// The disk needs more blocks than the largest cache size.
+//
+int MissBench(DiskSystem &disk, SIZE_T maxcachesize, const SIZE_T misses)
+{
+  SIZE_T blocksize = disk.GetBlockSize();
+
+  if (maxcachesize>=disk.GetNumBlocks()) {
+    maxcachesize=disk.GetNumBlocks()-1;
+  }
+
+  cerr << "cachesize\tus/miss\tsimtime/miss\n";
+
+  for (SIZE_T cachesize=64; cachesize<=maxcachesize; cachesize*=4) {
+    BufferCache cache(&disk,cachesize);
+    Block block(blocksize);
+    ERROR_T rc;
+    SIZE_T next;
+
+    cache.Attach();
+    // the cycle is sequential, and read-ahead would hide the misses
+    cache.SetReadAhead(false);
+
+    for (next=0;next<cachesize;next++) {
+      if ((rc=cache.ReadBlock(next,block))!=ERROR_NOERROR) {
+	cerr << "Error " << rc <<" occured when reading block "<< next << endl;
+	return -1;
+      }
+    }
+
+    SIZE_T diskreads=cache.GetNumDiskReads();
+    double simstart=cache.GetCurrentTime();
+    double start=walltime();
+
+    for (SIZE_T i=0;i<misses;i++) {
+      if ((rc=cache.ReadBlock(next,block))!=ERROR_NOERROR) {
+	cerr << "Error " << rc <<" occured when reading block "<< next << endl;
+	return -1;
+      }
+      next=(next+1)%(cachesize+1);
+    }
+
+    double elapsed=walltime()-start;
+
+    if (cache.GetNumDiskReads()-diskreads!=misses) {
+      cerr << "Expected every read to miss at cachesize "<<cachesize<<endl;
+    }
+
+    cerr << cachesize << "\t"
+	 << elapsed/misses << "\t"
+	 << (cache.GetCurrentTime()-simstart)/misses << endl;
+
+    cache.Detach();
+  }
+
+  return 0;
+}
+
+
+struct ThreadArgs {
+  BufferCache *cache;
+  SIZE_T       cachesize;
+  SIZE_T       ops;
+  unsigned     seed;
+  ERROR_T      rc;
+};
+
+//
+// One worker: uniformly random blocks from the cached range,
+// one write in ten
+//
+static void *Worker(void *arg)
+{
+  ThreadArgs *a=(ThreadArgs *)arg;
+  Block block(a->cache->GetBlockSize());
+
+  a->rc=ERROR_NOERROR;
+  for (SIZE_T i=0;i<a->ops;i++) {
+    SIZE_T blocknum=rand_r(&(a->seed))%a->cachesize;
+    if (rand_r(&(a->seed))%10==0) {
+      a->rc=a->cache->WriteBlock(blocknum,block);
+    } else {
+      a->rc=a->cache->ReadBlock(blocknum,block);
+    }
+    if (a->rc!=ERROR_NOERROR) {
+      break;
+    }
+  }
+  return 0;
+}
+
+//
+// Measures throughput of a sharded cache as threads are added.
+// The cache is filled first, so the workers measure the cost of
+// hits and of the locking around them rather than the disk.  Only
+// as many threads as there are CPUs online can run at once, so the
+// speedup is marked as meaningless past that.
+//
+int ThreadBench(DiskSystem &disk, const SIZE_T maxthreads, const SIZE_T numshards,
+		SIZE_T cachesize, const SIZE_T ops)
+{
+  if (cachesize>=disk.GetNumBlocks()) {
+    cachesize=disk.GetNumBlocks()-1;
+  }
+
+  long cpus=sysconf(_SC_NPROCESSORS_ONLN);
+
+  cerr << "cpus online: " << cpus << "\n";
+  cerr << "threads\tshards\tops/s\tspeedup\n";
+
+  double base=0;
+
+  for (SIZE_T nthreads=1; nthreads<=maxthreads; nthreads*=2) {
+    BufferCache cache(&disk,cachesize,POLICY_LRU,numshards);
+    Block block(disk.GetBlockSize());
+    vector<pthread_t> threads(nthreads);
+    vector<ThreadArgs> args(nthreads);
+    ERROR_T rc;
+
+    cache.Attach();
+    for (SIZE_T b=0;b<cachesize;b++) {
+      if ((rc=cache.ReadBlock(b,block))!=ERROR_NOERROR) {
+	cerr << "Error " << rc <<" occured when reading block "<< b << endl;
+	return -1;
+      }
+    }
+
+    double start=walltime();
+
+    for (SIZE_T t=0;t<nthreads;t++) {
+      args[t].cache=&cache;
+      args[t].cachesize=cachesize;
+      args[t].ops=ops;
+      args[t].seed=t+1;
+      pthread_create(&(threads[t]),0,Worker,&(args[t]));
+    }
+    for (SIZE_T t=0;t<nthreads;t++) {
+      pthread_join(threads[t],0);
+    }
+    for (SIZE_T t=0;t<nthreads;t++) {
+      if (args[t].rc!=ERROR_NOERROR) {
+	cerr << "Error " << args[t].rc <<" occured in thread "<< t << endl;
+	return -1;
+      }
+    }
+
+    double elapsed=walltime()-start;
+    double rate=nthreads*ops/(elapsed/1e6);
+
+    if (nthreads==1) {
+      base=rate;
+    }
+    cerr << nthreads << "\t"
+	 << cache.GetNumShards() << "\t"
+	 << rate << "\t"
+	 << rate/base
+	 << ((long)nthreads>cpus ? "\t(more threads than cpus)" : "") << endl;
+
+    cache.Detach();
+  }
+
+  return 0;
+}
+
+
+//
+// Reads numbatches batches of uniformly random blocks, either a
+// block at a time in the order drawn or a batch at a time with
+// ReadBlocks, and reports the disk requests and simulated time.
+// Read-ahead is off, so that only the ordering and merging of
+// the misses differ.
+//
+static int RunBatches(DiskSystem &disk, const bool batched, const SIZE_T batchsize,
+		      const SIZE_T cachesize, const SIZE_T numbatches)
+{
+  BufferCache cache(&disk,cachesize);
+  Block block(disk.GetBlockSize());
+  vector<Block> blocks;
+  unsigned seed=1;
+  ERROR_T rc;
+
+  cache.Attach();
+  cache.SetReadAhead(false);
+
+  for (SIZE_T i=0;i<numbatches;i++) {
+    vector<SIZE_T> blocknums;
+    for (SIZE_T j=0;j<batchsize;j++) {
+      blocknums.push_back(rand_r(&seed)%disk.GetNumBlocks());
+    }
+    if (batched) {
+      rc=cache.ReadBlocks(blocknums,blocks);
+    } else {
+      rc=ERROR_NOERROR;
+      for (SIZE_T j=0;j<batchsize && rc==ERROR_NOERROR;j++) {
+	rc=cache.ReadBlock(blocknums[j],block);
+      }
+    }
+    if (rc!=ERROR_NOERROR) {
+      cerr << "Error " << rc <<" occured when reading batch "<< i << endl;
+      return -1;
+    }
+  }
+
+  cerr << (batched ? "batched" : "single") << "\t"
+       << cache.GetNumDiskReads() << "\t"
+       << cache.GetCurrentTime()/numbatches << endl;
+
+  cache.Detach();
+  return 0;
+}
+
+//
+// Measures the simulated time saved by ReadBlocks, with the same
+// batches read both ways.  Each way has its own disk, so that both
+// start with the head in the same place.
+//
+int BatchBench(const char *filestem, const SIZE_T batchsize, const SIZE_T cachesize,
+	       const SIZE_T numbatches)
+{
+  DiskSystem single(filestem);
+  DiskSystem batched(filestem);
+
+  cerr << "mode\tdiskreads\tsimtime/batch\n";
+  if (RunBatches(single,false,batchsize,cachesize,numbatches)) {
+    return -1;
+  }
+  return RunBatches(batched,true,batchsize,cachesize,numbatches);
+}
+
+
+int main(int argc, char *argv[])
+{
+  SIZE_T maxthreads=0;
+  SIZE_T numshards=16;
+  SIZE_T batchsize=0;
+  int opt;
+
+  while ((opt=getopt(argc,argv,"t:s:b:"))!=-1) {
+    switch (opt) {
+    case 't':
+      maxthreads=atoi(optarg);
+      break;
+    case 's':
+      numshards=atoi(optarg);
+      break;
+    case 'b':
+      batchsize=atoi(optarg);
+      break;
+    default:
+      usage();
+      exit(-1);
+    }
+  }
+
+  if (argc-optind<3) {
+    usage();
+    exit(-1);
+  }
+
+  if (batchsize>0) {
+    return BatchBench(argv[optind],batchsize,atoi(argv[optind+1]),atoi(argv[optind+2]));
+  }
+
+  DiskSystem disk(argv[optind]);
+
+  if (maxthreads>0) {
+    return ThreadBench(disk,maxthreads,numshards,atoi(argv[optind+1]),atoi(argv[optind+2]));
+  } else {
+    return MissBench(disk,atoi(argv[optind+1]),atoi(argv[optind+2]));
+  }
+}
@@ -0,0 +1,215 @@
+#include <string.h>
+
+#include "compress.h"
+
+
+static SIZE_T Read32(const BYTE_T *p)
+{
+  return (SIZE_T)p[0] | ((SIZE_T)p[1]<<8) | ((SIZE_T)p[2]<<16) | ((SIZE_T)p[3]<<24);
+}
+
+static SIZE_T Hash32(const SIZE_T x)
+{
+  return ((x*2654435761U)&0xffffffffU)>>(32-LZ_HASH_BITS);
+}
+
+// The part of a length that does not fit in its nibble
+static void PutLength(vector<BYTE_T> &out, SIZE_T len)
+{
+  while (len>=255) {
+    out.push_back(255);
+    len-=255;
+  }
+  out.push_back((BYTE_T)len);
+}
+
+static bool GetLength(const BYTE_T *in, const SIZE_T inlen, SIZE_T &ip, SIZE_T &len)
+{
+  BYTE_T b;
+
+  do {
+    if (ip>=inlen) {
+      return false;
+    }
+    b=in[ip++];
+    len+=b;
+  } while (b==255);
+  return true;
+}
+
+static void PutSequence(vector<BYTE_T> &out, const BYTE_T *lit, const SIZE_T numlit,
+			const SIZE_T offset, const SIZE_T matchlen)
+{
+  SIZE_T m = matchlen>0 ? matchlen-LZ_MIN_MATCH : 0;
+
+  out.push_back((BYTE_T)(((numlit<15 ? numlit : 15)<<4) | (m<15 ? m : 15)));
+  if (numlit>=15) {
+    PutLength(out,numlit-15);
+  }
+  out.insert(out.end(),lit,lit+numlit);
+  if (matchlen>0) {
+    out.push_back((BYTE_T)(offset&0xff));
+    out.push_back((BYTE_T)(offset>>8));
+    if (m>=15) {
+      PutLength(out,m-15);
+    }
+  }
+}
+
+
+void LZCompress(const BYTE_T *in, const SIZE_T len, vector<BYTE_T> &out)
+{
+  SIZE_T table[1<<LZ_HASH_BITS];
+  SIZE_T anchor=0;
+  SIZE_T i=0;
+
+  out.clear();
+  out.reserve(len+len/255+16);
+  for (SIZE_T h=0;h<(1U<<LZ_HASH_BITS);h++) {
+    table[h]=(SIZE_T)-1;
+  }
+
+  while (i+LZ_MIN_MATCH<=len) {
+    SIZE_T seq=Read32(in+i);
+    SIZE_T h=Hash32(seq);
+    SIZE_T cand=table[h];
+
+    table[h]=i;
+    if (cand!=(SIZE_T)-1 && i-cand<=LZ_MAX_OFFSET && Read32(in+cand)==seq) {
+      SIZE_T m=LZ_MIN_MATCH;
+      while (i+m<len && in[cand+m]==in[i+m]) {
+	m++;
+      }
+      PutSequence(out,in+anchor,i-anchor,i-cand,m);
+      i+=m;
+      anchor=i;
+    } else {
+      i++;
+    }
+  }
+  PutSequence(out,in+anchor,len-anchor,0,0);
+}
+
+
+ERROR_T LZDecompress(const BYTE_T *in, const SIZE_T inlen, BYTE_T *out, const SIZE_T outlen)
+{
+  SIZE_T ip=0;
+  SIZE_T op=0;
+
+  while (ip<inlen) {
+    BYTE_T token=in[ip++];
+    SIZE_T numlit=token>>4;
+
+    if (numlit==15 && !GetLength(in,inlen,ip,numlit)) {
+      return ERROR_SIZE;
+    }
+    if (numlit>inlen-ip || numlit>outlen-op) {
+      return ERROR_SIZE;
+    }
+    memcpy(out+op,in+ip,numlit);
+    ip+=numlit;
+    op+=numlit;
+    if (ip==inlen) {
+      // the last sequence
+      break;
+    }
+
+    if (inlen-ip<2) {
+      return ERROR_SIZE;
+    }
+    SIZE_T offset=(SIZE_T)in[ip] | ((SIZE_T)in[ip+1]<<8);
+    SIZE_T matchlen=token&15;
+    ip+=2;
+    if (matchlen==15 && !GetLength(in,inlen,ip,matchlen)) {
+      return ERROR_SIZE;
+    }
+    matchlen+=LZ_MIN_MATCH;
+    if (offset==0 || offset>op || matchlen>outlen-op) {
+      return ERROR_SIZE;
+    }
+    // byte at a time, since the match may overlap its own output
+    for (SIZE_T j=0;j<matchlen;j++,op++) {
+      out[op]=out[op-offset];
+    }
+  }
+  return op==outlen ? ERROR_NOERROR : ERROR_SIZE;
+}
+
+
+CompressedTier::CompressedTier(const SIZE_T c) : capacity(c), used(0)
+{}
+
+
+SIZE_T CompressedTier::Put(const SIZE_T blocknum, const Block &block)
+{
+  Erase(blocknum);
+
+  LZCompress(block.data,block.length,scratch);
+
+  bool   raw  = scratch.size()>=block.length;
+  SIZE_T size = raw ? block.length : scratch.size();
+
+  if (size>capacity) {
+    return 0;
+  }
+  while (used+size>capacity) {
+    Erase(order.back());
+  }
+
+  Entry &e=entries[blocknum];
+  if (raw) {
+    e.data.assign(block.data,block.data+block.length);
+  } else {
+    e.data.assign(scratch.begin(),scratch.end());
+  }
+  e.length=block.length;
+  e.raw=raw;
+  order.push_front(blocknum);
+  e.pos=order.begin();
+  used+=size;
+  return size;
+}
+
+
+ERROR_T CompressedTier::Get(const SIZE_T blocknum, Block &block)
+{
+  unordered_map<SIZE_T, Entry, cache_hash>::iterator i=entries.find(blocknum);
+  ERROR_T rc;
+
+  if (i==entries.end()) {
+    return ERROR_NONEXISTENT;
+  }
+  Entry &e=(*i).second;
+
+  if ((rc=block.Resize(e.length,false))!=ERROR_NOERROR) {
+    return rc;
+  }
+  if (e.raw) {
+    memcpy(block.data,&(e.data[0]),e.length);
+  } else {
+    rc=LZDecompress(&(e.data[0]),e.data.size(),block.data,e.length);
+  }
+  Erase(blocknum);
+  return rc;
+}
+
+
+void CompressedTier::Erase(const SIZE_T blocknum)
+{
+  unordered_map<SIZE_T, Entry, cache_hash>::iterator i=entries.find(blocknum);
+
+  if (i==entries.end()) {
+    return;
+  }
+  used-=(*i).second.data.size();
+  order.erase((*i).second.pos);
+  entries.erase(i);
+}
+
+
+void CompressedTier::Clear()
+{
+  entries.clear();
+  order.clear();
+  used=0;
+}
@@ -0,0 +1,75 @@
+#ifndef _compress
+#define _compress
+
+#include <list>
+#include <vector>
+#include <unordered_map>
+
+#include "global.h"
+#include "block.h"
+#include "replacement.h"
+
+using namespace std;
+
+
+//
+// A small LZ77 codec in the style of LZ4.  The output is a series of
+// sequences, each a token byte, a run of literals, a two byte offset
+// back into the output, and a match length.  The high nibble of the
+// token is the literal count and the low nibble the match length
+// less LZ_MIN_MATCH, a nibble of 15 being followed by bytes that add
+// to it until one is below 255.  The last sequence has literals only.
+// Matches are found through a hash of the next four bytes, which is
+// cheap and does well on blocks of fixed width keys and values.
+//
+const SIZE_T LZ_MIN_MATCH=4;
+const SIZE_T LZ_MAX_OFFSET=65535;
+const SIZE_T LZ_HASH_BITS=12;
+
+void    LZCompress(const BYTE_T *in, const SIZE_T len, vector<BYTE_T> &out);
+// returns one of ERROR_NOERROR (zero)
+// ERROR_SIZE if the input is malformed or does not decode to
+// exactly outlen bytes
+ERROR_T LZDecompress(const BYTE_T *in, const SIZE_T inlen, BYTE_T *out, const SIZE_T outlen);
+
+
+//
+// Second tier of a buffer cache: clean blocks evicted from the first
+// tier, kept compressed in memory up to a budget in bytes, and thrown
+// out oldest first when the budget runs short.  A block that does not
+// compress is kept as it is.  Get hands a block back and forgets it,
+// so a block is never in both tiers at once.
+//
+class CompressedTier {
+ private:
+  struct Entry {
+    vector<BYTE_T>         data;
+    SIZE_T                 length;
+    bool                   raw;
+    list<SIZE_T>::iterator pos;
+  };
+  SIZE_T capacity;
+  SIZE_T used;
+  unordered_map<SIZE_T, Entry, cache_hash> entries;
+  list<SIZE_T> order;           // front is newest
+  vector<BYTE_T> scratch;
+ public:
+  // capacity is in bytes of compressed data
+  CompressedTier(const SIZE_T capacity);
+
+  // returns the number of bytes kept, zero if the block did not fit
+  SIZE_T  Put(const SIZE_T blocknum, const Block &block);
+  // returns one of ERROR_NOERROR (zero)
+  // ERROR_NONEXISTENT if the block is not here, or ERROR_SIZE
+  ERROR_T Get(const SIZE_T blocknum, Block &block);
+  bool    Contains(const SIZE_T blocknum) const { return entries.count(blocknum)!=0; }
+  void    Erase(const SIZE_T blocknum);
+  void    Clear();
+
+  SIZE_T  GetCapacity() const { return capacity; }
+  SIZE_T  GetBytesUsed() const { return used; }
+  SIZE_T  GetNumBlocks() const { return entries.size(); }
+};
+
+
+#endif
@@ -0,0 +1,227 @@
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "disksystem.h"
+
+
+void usage()
+{
+  cerr << "usage: diskbench [-o] filestem numops [runblocks]\n";
+  cerr << "       diskbench [-o] -q maxdepth filestem numops\n";
+  cerr << "       -o uses direct I/O, with the backends that have it\n";
+  cerr << "       overwrites the data of the disk\n";
+}
+
+static double walltime()
+{
+  struct timeval tv;
+  gettimeofday(&tv,0);
+  return tv.tv_sec*1e6 + tv.tv_usec;
+}
+
+
+//
+// Measures the wall clock throughput of single block reads and
+// writes through the uring backend as the queue depth doubles from
+// one.  Each depth keeps that many requests in flight, submitting a
+// new one as the oldest is waited for.  What the OS caches of the
+// file is dropped before each pass, so that reads go to the device.
+//
+int DepthBench(DiskSystem &disk, const SIZE_T maxdepth, const SIZE_T numops)
+{
+  SIZE_T blocksize=disk.GetBlockSize();
+
+  cerr << "depth\top\tops/s\tMB/s\n";
+
+  for (SIZE_T depth=1;depth<=maxdepth;depth*=2) {
+    ERROR_T rc;
+
+    if ((rc=disk.SetStorage(STORAGE_URING,depth))!=ERROR_NOERROR) {
+      cerr << "Can't switch to uring storage due to error "<<rc<<endl;
+      return -1;
+    }
+
+    for (SIZE_T pass=0;pass<2;pass++) {
+      bool write = pass==1;
+      vector<Block> blocks(depth,Block(blocksize));
+      vector<SIZE_T> tickets(depth,0);
+      unsigned seed=1;
+
+      disk.Sync();
+      disk.Advise(ADVISE_DONTNEED);
+      disk.Advise(ADVISE_RANDOM);
+
+      double start=walltime();
+
+      for (SIZE_T i=0;i<numops+depth;i++) {
+	SIZE_T k=i%depth;
+	double reqtime;
+	if (tickets[k] && (rc=disk.Wait(tickets[k]))!=ERROR_NOERROR) {
+	  cerr << "Error "<<rc<<" occured at depth "<<depth<<endl;
+	  return -1;
+	}
+	tickets[k]=0;
+	if (i>=numops) {
+	  continue;
+	}
+	SIZE_T blocknum=rand_r(&seed)%disk.GetNumBlocks();
+	if (write) {
+	  vector<Block> one(1,blocks[k]);
+	  rc=disk.SubmitWrite(blocknum,1,one,reqtime,tickets[k]);
+	} else {
+	  rc=disk.SubmitRead(blocknum,blocks[k],reqtime,tickets[k]);
+	}
+	if (rc!=ERROR_NOERROR) {
+	  cerr << "Error "<<rc<<" occured at block "<<blocknum<<endl;
+	  return -1;
+	}
+      }
+      if (write && (rc=disk.Sync())!=ERROR_NOERROR) {
+	cerr << "Can't sync due to error "<<rc<<endl;
+	return -1;
+      }
+
+      double elapsed=walltime()-start;
+
+      cerr << depth << "\t"
+	   << (write ? "write" : "read") << "\t"
+	   << numops/(elapsed/1e6) << "\t"
+	   << (double)numops*blocksize/elapsed << endl;
+    }
+  }
+  return 0;
+}
+
+
+//
+// Measures the wall clock throughput of DiskSystem::Write and Read,
+// the calls writedisk and readdisk make, through each storage
+// backend.  Each op moves a run of runblocks blocks at a random
+// place, the same places for each backend, and the writes are
+// synced to the file before the clock stops.  The simulated time is
+// reported too, and should not depend on the backend, apart from
+// where the head starts for the first pass.
+//
+int main(int argc, char *argv[])
+{
+  SIZE_T maxdepth=0;
+  bool directio=false;
+  int opt;
+
+  while ((opt=getopt(argc,argv,"q:o"))!=-1) {
+    switch (opt) {
+    case 'q':
+      maxdepth=atoi(optarg);
+      break;
+    case 'o':
+      directio=true;
+      break;
+    default:
+      usage();
+      return -1;
+    }
+  }
+  argc-=optind-1;
+  argv+=optind-1;
+
+  if (maxdepth>0) {
+    if (argc!=3) {
+      usage();
+      return -1;
+    }
+    DiskSystem disk(argv[1]);
+    if (directio && disk.SetDirectIO(true)!=ERROR_NOERROR) {
+      return -1;
+    }
+    return DepthBench(disk,maxdepth,atoi(argv[2]));
+  }
+
+  if (argc!=3 && argc!=4) {
+    usage();
+    return -1;
+  }
+
+  SIZE_T numops=atoi(argv[2]);
+  SIZE_T runblocks = argc==4 ? atoi(argv[3]) : 1;
+  DiskStorageType types[] = {STORAGE_STDIO, STORAGE_PREAD, STORAGE_MMAP, STORAGE_MMAP_SYNC, STORAGE_URING};
+  const char *names[] = {"stdio", "pread", "mmap", "mmap-sync", "uring"};
+  const SIZE_T numtypes=sizeof(types)/sizeof(types[0]);
+
+  DiskSystem disk(argv[1]);
+  SIZE_T blocksize=disk.GetBlockSize();
+
+  if (directio && disk.SetDirectIO(true)!=ERROR_NOERROR) {
+    return -1;
+  }
+
+  if (runblocks==0 || runblocks>disk.GetNumBlocks()) {
+    usage();
+    return -1;
+  }
+
+  vector<Block> out;
+  for (SIZE_T i=0;i<runblocks;i++) {
+    Block b(blocksize);
+    for (SIZE_T j=0;j<blocksize;j++) {
+      b.data[j]='a'+(i+j)%26;
+    }
+    out.push_back(b);
+  }
+
+  cerr << "storage\top\tops/s\tMB/s\tsimtime\n";
+
+  for (SIZE_T t=0;t<numtypes;t++) {
+    ERROR_T rc;
+
+    if ((rc=disk.SetStorage(types[t]))!=ERROR_NOERROR) {
+      if (directio && rc==ERROR_BADCONFIG) {
+	// no direct I/O with this one
+	continue;
+      }
+      cerr << "Can't switch to "<<names[t]<<" storage due to error "<<rc<<endl;
+      return -1;
+    }
+    disk.Advise(ADVISE_RANDOM);
+
+    for (SIZE_T pass=0;pass<2;pass++) {
+      bool write = pass==0;
+      unsigned seed=1;
+      double simtime=0;
+      double start=walltime();
+
+      for (SIZE_T i=0;i<numops;i++) {
+	SIZE_T blocknum=rand_r(&seed)%(disk.GetNumBlocks()-runblocks+1);
+	double reqtime;
+	if (write) {
+	  rc=disk.Write(blocknum,runblocks,out,reqtime);
+	} else {
+	  vector<Block> in;
+	  rc=disk.Read(blocknum,runblocks,in,reqtime);
+	}
+	if (rc!=ERROR_NOERROR) {
+	  cerr << "Error "<<rc<<" occured at block "<<blocknum<<endl;
+	  return -1;
+	}
+	simtime+=reqtime;
+      }
+
+      if (write && (rc=disk.Sync())!=ERROR_NOERROR) {
+	cerr << "Can't sync due to error "<<rc<<endl;
+	return -1;
+      }
+
+      double elapsed=walltime()-start;
+
+      cerr << names[t] << "\t"
+	   << (write ? "write" : "read") << "\t"
+	   << numops/(elapsed/1e6) << "\t"
+	   << (double)numops*runblocks*blocksize/elapsed << "\t"
+	   << simtime << endl;
+    }
+  }
+
+  return 0;
+}
@@ -1,5 +1,6 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 #include <string.h>
@@ -8,67 +9,7 @@
 #include <math.h>
 
 #include "disksystem.h"
-
-
-static SIZE_T mywrite(FILE *f, const SIZE_T off, const BYTE_T *buf, const int len)
-{
-  SIZE_T left=len;
-  SIZE_T sent;
-
-  fseek(f,off,SEEK_SET);
-  while (left>0) {
-    sent=fwrite(&(buf[len-left]),1,left,f);
-    if (sent<0) {	
-      return 0;
-    } else if (sent==0) {
-      break;
-    } else {
-      left-=sent;
-    }
-  }
-  return len-left;
-}
-
-static SIZE_T myread(FILE *f, const SIZE_T off, BYTE_T *buf, const int len, bool trunconeof=true)
-{
-  SIZE_T left=len;
-  SIZE_T sent;
-
-  fseek(f,off,SEEK_SET);
-  while (left>0) {
-    sent=fread(&(buf[len-left]),1,left,f);
-    if (sent<0) {	
-      return 0;
-    } else if (sent==0) {
-      // if we reached this point, the likely cause is that we
-      // are trying to read a block which has not been allocated yet
-      // Hence, we will try to ftruncate to this size and then retry the
-      // read.  However, we don't want to loop forever doing this,
-      // hence the trunconeof parameter
-      if (!feof(f)) { 
-	// OK, the end of file is not the problem
-	break;
-      } else {
-	// EOF case... should we truncate and try again?
-	if (!trunconeof) { 
-	  break;
-	} else {
-	  // yes!
-	  if (ftruncate(fileno(f),off+len)) { 
-	    // uh oh, something weird is going on
-	    break;
-	  } else {
-	    // OK, now retry, but don't truncate a second time
-	    return myread(f,off,buf,len,false);
-	  }
-	}
-      }
-    } else {
-      left-=sent;
-    }
-  }
-  return len-left;
-}
+#include "bufpool.h"
 
 
 DiskSystem::DiskSystem(const string &filestem,
@@ -83,9 +24,13 @@ DiskSystem::DiskSystem(const string &filestem,
 		       const double trackseek,
 		       const double rotlat) :
   bitmap(0),
-  datafilefd(0),
+  storagetype(STORAGE_PREAD),
+  datafile(MakeDiskStorage(STORAGE_PREAD)),
   configfilefd(0),
-  bitmapfilefd(0),
+  bitmapfile(MakeDiskStorage(STORAGE_PREAD)),
+  queuedepth(STORAGE_QUEUE_DEPTH),
+  directalign(0),
+  nextticket(1),
   diskfilestem(filestem), 
   offset(offset),
   numblocks(blcks),
@@ -105,15 +50,18 @@ DiskSystem::DiskSystem(const string &filestem,
   } else {
     InitFromConfigFile();
   }
+  // blocks and node data of this disk are pooled
+  BufferPool::SetBlockSize(blocksize);
 }
 
 DiskSystem::~DiskSystem()
 {
+  Drain();
   WriteConfig();
   WriteBitMap();
-  fclose(configfilefd);
-  fclose(bitmapfilefd);
-  fclose(datafilefd);
+  if (configfilefd) { fclose(configfilefd); }
+  delete bitmapfile;
+  delete datafile;
   delete [] bitmap;
 }
 
@@ -203,11 +151,9 @@ ERROR_T DiskSystem::ReadConfig()
 
 ERROR_T DiskSystem::WriteBitMap()
 {
-  rewind(bitmapfilefd);
-  
   SIZE_T numbitmapbytes = numblocks / 8 + (numblocks%8 != 0); 
 
-  if (mywrite(bitmapfilefd,0,bitmap,numbitmapbytes)!=numbitmapbytes) { 
+  if (bitmapfile->Write(0,bitmap,numbitmapbytes)!=numbitmapbytes) { 
     cerr << "Can't write bitmap file\n";
     return ERROR_IMPLBUG;
   }
@@ -216,15 +162,13 @@ ERROR_T DiskSystem::WriteBitMap()
 
 ERROR_T DiskSystem::ReadBitMap()
 {
-  rewind(bitmapfilefd);
-  
   SIZE_T numbitmapbytes = numblocks / 8 + (numblocks%8 != 0); 
 
   if (bitmap) { delete [] bitmap; } ;
 
   bitmap = new BYTE_T [numbitmapbytes];
 
-  if (myread(bitmapfilefd,0,bitmap,numbitmapbytes,false)!=numbitmapbytes) { 
+  if (bitmapfile->Read(0,bitmap,numbitmapbytes,false)!=numbitmapbytes) { 
     cerr << "Can't read bitmap file\n";
     return ERROR_IMPLBUG;
   }
@@ -257,16 +201,12 @@ ERROR_T DiskSystem::InitFromConfigFile()
     return rc;
   }
 
-  if (datafilefd) { fclose(datafilefd);}
-
-  if ((datafilefd = fopen(dataname.c_str(),"r+"))==0) { 
+  if (datafile->Open(dataname,false)!=ERROR_NOERROR) { 
     return ERROR_NOFILE;
   }
 
 
-  if (bitmapfilefd) { fclose(bitmapfilefd);}
-
-  if ((bitmapfilefd = fopen(bitmapname.c_str(),"r+"))==0) { 
+  if (bitmapfile->Open(bitmapname,false)!=ERROR_NOERROR) { 
     return ERROR_NOFILE;
   }
   
@@ -332,9 +272,7 @@ ERROR_T DiskSystem::InitFromInMemoryConfig()
 
   // create the bitmap file and write out the bitmap
 
-  if (bitmapfilefd) { fclose(bitmapfilefd); }
-
-  if ((bitmapfilefd = fopen(bitmapname.c_str(),"w+"))==0) { 
+  if (bitmapfile->Open(bitmapname,true)!=ERROR_NOERROR) { 
     return ERROR_NOFILE;
   }
 
@@ -348,16 +286,14 @@ ERROR_T DiskSystem::InitFromInMemoryConfig()
   // notice that we will REUSE an existing data file if it exists
   // The idea is that we will write only from offset to offset+blocksize*numblocks
 
-  if (datafilefd) { fclose(datafilefd);}
-
   if (stat(dataname.c_str(),&s)!=-1) { 
     // reuse existing datafile
-    if ((datafilefd = fopen(dataname.c_str(),"r+"))==0) { 
+    if (datafile->Open(dataname,false)!=ERROR_NOERROR) { 
       return ERROR_NOFILE;
     }
   } else {
     // create new data file
-    if ((datafilefd = fopen(dataname.c_str(),"w+"))==0) { 
+    if (datafile->Open(dataname,true)!=ERROR_NOERROR) { 
       return ERROR_NOFILE;
     }
   }
@@ -428,17 +364,31 @@ ERROR_T DiskSystem::Read(const SIZE_T   inoffblock,
   reqtime=ModelAccess(inoffblock,numblock);
 
   for (SIZE_T i=0;i<numblock;i++) { 
-    Block b(blocksize);
     if (!IsBlockAllocated(inoffblock+i)) { 
       if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
 	cerr <<"DiskSystem::Read: reading unallocated block "<<(i+inoffblock)<<endl;
       }
     }
-    if (myread(datafilefd,offset+(inoffblock+i)*blocksize,b.data,blocksize,true)!=blocksize) { 
-      cerr << "DiskSystem::Read: myread has failed"<<endl;
-      return ERROR_IMPLBUG;
-    }
-    blocks.push_back(b);
+  }
+
+  if (numblock==0) { 
+    return ERROR_NOERROR;
+  }
+
+  // One seek and one read for the whole run
+  vector<BYTE_T> space;
+  BYTE_T *buf=Aligned(space,numblock*blocksize);
+
+  if (datafile->Read(offset+inoffblock*blocksize,buf,numblock*blocksize,true)!=numblock*blocksize) { 
+    cerr << "DiskSystem::Read: read has failed"<<endl;
+    return ERROR_IMPLBUG;
+  }
+
+  blocks.reserve(blocks.size()+numblock);
+  for (SIZE_T i=0;i<numblock;i++) { 
+    Block b(blocksize);
+    memcpy(b.data,buf+i*blocksize,blocksize);
+    blocks.push_back(std::move(b));
   }
 
   return ERROR_NOERROR;
@@ -458,52 +408,382 @@ ERROR_T DiskSystem::Write(const SIZE_T   inoffblock,
 
   reqtime=ModelAccess(inoffblock,numblock);
 
+  if (numblock==0) { 
+    return ERROR_NOERROR;
+  }
+
+  // Gather the run so that it goes out with one seek and one write
+  vector<BYTE_T> space;
+  BYTE_T *buf=Aligned(space,numblock*blocksize);
+
   for (SIZE_T i=0;i<numblock;i++) { 
     if (!IsBlockAllocated(inoffblock+i)) { 
       if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
 	cerr <<"DiskSystem::Write: writing unallocated block "<<(i+inoffblock)<<endl;
       }
     }
-    if (mywrite(datafilefd,offset+(inoffblock+i)*blocksize,blocks[i].data,blocksize)!=blocksize) {  
-      cerr << "DiskSystem::Write: mywrite has failed"<<endl;
+    memcpy(buf+i*blocksize,blocks[i].data,blocksize);
+  }
+
+  if (datafile->Write(offset+inoffblock*blocksize,buf,numblock*blocksize)!=numblock*blocksize) {  
+    cerr << "DiskSystem::Write: write has failed"<<endl;
+    return ERROR_IMPLBUG;
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+// Straight into the block, which keeps its buffer if it is already
+// the right size, as a buffer cache frame is
+ERROR_T DiskSystem::Read(const SIZE_T inoffblock, Block &blocks, double &reqtime)
+{
+  reqtime=0;
+
+  if (inoffblock >= numblocks) { 
+    cerr << "DiskSystem::Read: Attempt to read block "<<inoffblock<<", but maxmimum block is only "<<(numblocks-1)<<endl;
+    return ERROR_NOSPACE;
+  }
+
+  reqtime=ModelAccess(inoffblock,1);
+
+  if (!IsBlockAllocated(inoffblock)) { 
+    if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
+      cerr <<"DiskSystem::Read: reading unallocated block "<<inoffblock<<endl;
+    }
+  }
+
+  if (blocks.Resize(blocksize,false)!=ERROR_NOERROR) { 
+    return ERROR_NOMEM;
+  }
+
+  if (!IsAligned(blocks.data)) { 
+    vector<BYTE_T> space;
+    BYTE_T *buf=Aligned(space,blocksize);
+    if (datafile->Read(offset+inoffblock*blocksize,buf,blocksize,true)!=blocksize) { 
+      cerr << "DiskSystem::Read: read has failed"<<endl;
       return ERROR_IMPLBUG;
     }
+    memcpy(blocks.data,buf,blocksize);
+    return ERROR_NOERROR;
+  }
+
+  if (datafile->Read(offset+inoffblock*blocksize,blocks.data,blocksize,true)!=blocksize) { 
+    cerr << "DiskSystem::Read: read has failed"<<endl;
+    return ERROR_IMPLBUG;
   }
 
   return ERROR_NOERROR;
 }
 
+// Straight from the block, as the single block Read goes straight
+// into it
+ERROR_T DiskSystem::Write(const SIZE_T inoffblock, const Block &blocks, double &reqtime)
+{
+  reqtime=0;
 
-ERROR_T DiskSystem::Read(const SIZE_T inoffblock, Block &blocks, double &reqtime)
+  if (inoffblock >= numblocks) { 
+    cerr << "DiskSystem::Write: Attempt to write block "<<inoffblock<<", but maxmimum block is only "<<(numblocks-1)<<endl;
+    return ERROR_NOSPACE;
+  }
+
+  reqtime=ModelAccess(inoffblock,1);
+
+  if (!IsBlockAllocated(inoffblock)) { 
+    if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
+      cerr <<"DiskSystem::Write: writing unallocated block "<<inoffblock<<endl;
+    }
+  }
+
+  const BYTE_T *buf=blocks.data;
+  vector<BYTE_T> space;
+
+  if (!IsAligned(buf) || blocks.length<blocksize) { 
+    // through an aligned copy, padded with zeros if it is short
+    SIZE_T len = blocks.length<blocksize ? blocks.length : blocksize;
+    BYTE_T *copy=Aligned(space,blocksize);
+    memcpy(copy,blocks.data,len);
+    memset(copy+len,0,blocksize-len);
+    buf=copy;
+  }
+
+  if (datafile->Write(offset+inoffblock*blocksize,buf,blocksize)!=blocksize) {  
+    cerr << "DiskSystem::Write: write has failed"<<endl;
+    return ERROR_IMPLBUG;
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T DiskSystem::SetStorage(const DiskStorageType type, const SIZE_T depth)
+{
+  DiskStorage *data=MakeDiskStorage(type,depth);
+  DiskStorage *bits=MakeDiskStorage(type,depth);
+
+  if (!data || !bits || data->SetDirect(directalign>0)!=ERROR_NOERROR) { 
+    delete data;
+    delete bits;
+    return ERROR_BADCONFIG;
+  }
+  // the old ones go first, so that anything they buffer is in the
+  // files before the new ones open them
+  Drain();
+  WriteBitMap();
+  delete datafile;
+  delete bitmapfile;
+  datafile=data;
+  bitmapfile=bits;
+  storagetype=type;
+  queuedepth=depth;
+  if (datafile->Open(diskfilestem + ".data",false)!=ERROR_NOERROR ||
+      bitmapfile->Open(diskfilestem + ".bitmap",false)!=ERROR_NOERROR) { 
+    return ERROR_NOFILE;
+  }
+  return ERROR_NOERROR;
+}
+
+DiskStorageType DiskSystem::GetStorage() const
+{
+  return storagetype;
+}
+
+void DiskSystem::Advise(const DiskStorageAdvice advice)
 {
-  vector<Block> bl;
+  datafile->Advise(advice);
+}
 
-  ERROR_T rc = Read(inoffblock,1,bl,reqtime);
+ERROR_T DiskSystem::Sync()
+{
+  ERROR_T rc=WriteBitMap();
 
   if (rc!=ERROR_NOERROR) { 
     return rc;
   }
+  if ((rc=bitmapfile->Sync())!=ERROR_NOERROR) { 
+    return rc;
+  }
+  return datafile->Sync();
+}
+
+
+// Sizes buf to hold len bytes from an address that direct I/O can
+// use, and returns that address
+BYTE_T *DiskSystem::Aligned(vector<BYTE_T> &buf, const SIZE_T len) const
+{
+  buf.resize(len+directalign);
+
+  BYTE_T *p=&(buf[0]);
+
+  if (directalign>0) { 
+    p+=(directalign-(size_t)p%directalign)%directalign;
+  }
+  return p;
+}
+
+bool DiskSystem::IsAligned(const BYTE_T *p) const
+{
+  return directalign==0 || (size_t)p%directalign==0;
+}
+
+
+ERROR_T DiskSystem::SetDirectIO(const bool enable)
+{
+  SIZE_T align=0;
+
+  if (enable) { 
+    // what the file system wants, where it can say
+    align=DISK_DIRECT_ALIGN;
+#ifdef STATX_DIOALIGN
+    struct statx sx;
+    if (statx(AT_FDCWD,(diskfilestem + ".data").c_str(),0,STATX_DIOALIGN,&sx)==0 &&
+	(sx.stx_mask & STATX_DIOALIGN)) { 
+      if (sx.stx_dio_offset_align==0) { 
+	cerr << "DiskSystem::SetDirectIO: the file system does not do direct I/O for "<<diskfilestem<<".data\n";
+	return ERROR_BADCONFIG;
+      }
+      align = sx.stx_dio_offset_align>sx.stx_dio_mem_align ? sx.stx_dio_offset_align : sx.stx_dio_mem_align;
+    }
+#endif
+    if (blocksize%align!=0 || offset%align!=0) { 
+      cerr << "DiskSystem::SetDirectIO: blocksize "<<blocksize<<" and offset "<<offset<<" must be multiples of "<<align<<endl;
+      return ERROR_BADCONFIG;
+    }
+  }
 
-  blocks = bl[0];
+  SIZE_T oldalign=directalign;
+  ERROR_T rc;
 
+  directalign=align;
+  if ((rc=SetStorage(storagetype,queuedepth))!=ERROR_NOERROR) { 
+    directalign=oldalign;
+    SetStorage(storagetype,queuedepth);
+    return rc;
+  }
+  BufferPool::SetAlignment(align);
   return ERROR_NOERROR;
 }
 
-ERROR_T DiskSystem::Write(const SIZE_T inoffblock, const Block &blocks, double &reqtime)
+
+ERROR_T DiskSystem::SubmitRead(const SIZE_T inoffblock, Block &block, double &reqtime,
+			       SIZE_T &ticket)
 {
-  vector<Block> bl;
+  reqtime=0;
+
+  if (inoffblock >= numblocks) { 
+    cerr << "DiskSystem::SubmitRead: Attempt to read block "<<inoffblock<<", but maxmimum block is only "<<(numblocks-1)<<endl;
+    return ERROR_NOSPACE;
+  }
 
-  bl.push_back(blocks);
+  reqtime=ModelAccess(inoffblock,1);
 
-  ERROR_T rc = Write(inoffblock,1,bl,reqtime);
+  if (!IsBlockAllocated(inoffblock)) { 
+    if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
+      cerr <<"DiskSystem::SubmitRead: reading unallocated block "<<inoffblock<<endl;
+    }
+  }
+
+  if (block.Resize(blocksize,false)!=ERROR_NOERROR) { 
+    return ERROR_NOMEM;
+  }
+
+  if (!IsAligned(block.data)) { 
+    // through a copy, so at once
+    double t;
+    PendingIO &p=pending[nextticket];
+    p.rc=Read(inoffblock,block,t);
+    p.done=true;
+    ticket=nextticket++;
+    return ERROR_NOERROR;
+  }
+
+  ERROR_T rc=datafile->SubmitRead(offset+inoffblock*blocksize,block.data,blocksize,nextticket);
 
   if (rc!=ERROR_NOERROR) { 
     return rc;
   }
+  PendingIO &p=pending[nextticket];
+  p.done=false;
+  p.rc=ERROR_NOERROR;
+  ticket=nextticket++;
+  return ERROR_NOERROR;
+}
+
+ERROR_T DiskSystem::SubmitWrite(const SIZE_T inoffblock, const SIZE_T numblock,
+				const vector<Block> &blocks, double &reqtime, SIZE_T &ticket)
+{
+  reqtime=0;
+
+  if (inoffblock+numblock > numblocks || numblock==0) { 
+    cerr << "DiskSystem::SubmitWrite: Attempt to write blocks "<<inoffblock<<" to "<<(inoffblock+numblock-1)<<", but maxmimum block is only "<<(numblocks-1)<<endl;
+    return ERROR_NOSPACE;
+  }
+
+  reqtime=ModelAccess(inoffblock,numblock);
+
+  PendingIO &p=pending[nextticket];
+  BYTE_T *buf=Aligned(p.buf,numblock*blocksize);
+
+  for (SIZE_T i=0;i<numblock;i++) { 
+    if (!IsBlockAllocated(inoffblock+i)) { 
+      if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
+	cerr <<"DiskSystem::SubmitWrite: writing unallocated block "<<(i+inoffblock)<<endl;
+      }
+    }
+    memcpy(buf+i*blocksize,blocks[i].data,blocksize);
+  }
+  p.done=false;
+  p.rc=ERROR_NOERROR;
+
+  ERROR_T rc=datafile->SubmitWrite(offset+inoffblock*blocksize,buf,numblock*blocksize,nextticket);
 
+  if (rc!=ERROR_NOERROR) { 
+    pending.erase(nextticket);
+    return rc;
+  }
+  ticket=nextticket++;
   return ERROR_NOERROR;
 }
 
+// Records at least min finished requests
+// returns ERROR_NOERROR, or ERROR_IMPLBUG if fewer came back
+ERROR_T DiskSystem::Reap(const SIZE_T min)
+{
+  vector<StorageCompletion> done;
+  ERROR_T rc=datafile->Poll(done,min);
+
+  for (SIZE_T i=0;i<done.size();i++) { 
+    unordered_map<SIZE_T, PendingIO>::iterator j=pending.find(done[i].tag);
+    if (j==pending.end()) { 
+      // already given up on by Wait
+      continue;
+    }
+    PendingIO &p=(*j).second;
+    p.done=true;
+    p.rc=done[i].rc;
+    // nothing more to keep for a write
+    vector<BYTE_T>().swap(p.buf);
+  }
+  if (rc==ERROR_NOERROR && done.size()<min) { 
+    rc=ERROR_IMPLBUG;
+  }
+  return rc;
+}
+
+// Finishes all requests, including those never to be waited for
+void DiskSystem::Drain()
+{
+  if (datafile) { 
+    Reap(datafile->GetNumOutstanding());
+  }
+}
+
+// Fails every request not yet done with rc.  The data file is
+// closed first, which for uring waits for what is in flight, or
+// cancels it, before the ring goes.  Only then can the kernel no
+// longer write into a read's block or read a write's copy.  The
+// file is then opened again for the requests that follow.
+void DiskSystem::Abandon(const ERROR_T rc)
+{
+  datafile->Close();
+  for (unordered_map<SIZE_T, PendingIO>::iterator i=pending.begin();i!=pending.end();++i) { 
+    PendingIO &p=(*i).second;
+    if (!p.done) { 
+      p.done=true;
+      p.rc=rc;
+      vector<BYTE_T>().swap(p.buf);
+    }
+  }
+  if (datafile->Open(diskfilestem + ".data",false)!=ERROR_NOERROR) { 
+    cerr << "DiskSystem::Abandon: can't reopen the data file"<<endl;
+  }
+}
+
+ERROR_T DiskSystem::Wait(const SIZE_T ticket)
+{
+  unordered_map<SIZE_T, PendingIO>::iterator i=pending.find(ticket);
+
+  if (i==pending.end()) { 
+    return ERROR_NONEXISTENT;
+  }
+  // reaping may rehash the table, but does not move its entries
+  PendingIO &p=(*i).second;
+
+  while (!p.done) { 
+    ERROR_T rc=Reap(1);
+    if (rc!=ERROR_NOERROR && !p.done) { 
+      // the storage can no longer say when it finishes, so fail
+      // it rather than wait forever
+      Abandon(rc);
+    }
+  }
+
+  ERROR_T rc=p.rc;
+
+  pending.erase(ticket);
+  return rc;
+}
+
 
 SIZE_T DiskSystem::GetBlockSize() const
 {
@@ -515,6 +795,21 @@ SIZE_T DiskSystem::GetNumBlocks() const
   return numblocks;
 }
 
+SIZE_T DiskSystem::GetTrack(const SIZE_T block) const
+{
+  return block / (numheads*blockspertrack);
+}
+
+SIZE_T DiskSystem::GetSector(const SIZE_T block) const
+{
+  return block % (numheads*blockspertrack);
+}
+
+SIZE_T DiskSystem::GetHeadTrack() const
+{
+  return last_track;
+}
+
 
 
 #define GETBIT(x) ((bitmap[(x)/8] >> (7-((x)%8))) & 0x1)
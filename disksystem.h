@@ -4,12 +4,17 @@
 #include <string>
 #include <iostream>
 #include <vector>
+#include <unordered_map>
 
 #include "global.h"
 #include "block.h"
+#include "storage.h"
 
 using namespace std;
 
+// Direct I/O alignment, where the file system cannot be asked
+const SIZE_T DISK_DIRECT_ALIGN=4096;
+
 // Models a single disk with a single outstanding request
 //
 // Includes storage allocator and free space bitmap to 
@@ -18,9 +23,30 @@ using namespace std;
 class DiskSystem {
  private:
   BYTE_T *bitmap;
-  FILE*  datafilefd;
+  DiskStorageType storagetype;
+  DiskStorage *datafile;
   FILE*  configfilefd;
-  FILE*  bitmapfilefd;
+  DiskStorage *bitmapfile;
+  SIZE_T queuedepth;
+  // alignment of buffers, offsets and lengths for direct I/O, or
+  // 0 when the data file goes through the OS's cache
+  SIZE_T directalign;
+
+  // Asynchronous requests not yet waited for.  A write keeps its
+  // own copy of the blocks.
+  struct PendingIO {
+    vector<BYTE_T> buf;         // padded to align its start
+    bool           done;
+    ERROR_T        rc;
+  };
+  unordered_map<SIZE_T, PendingIO> pending;
+  SIZE_T nextticket;
+
+  ERROR_T Reap(const SIZE_T min);
+  void    Drain();
+  void    Abandon(const ERROR_T rc);
+  BYTE_T *Aligned(vector<BYTE_T> &buf, const SIZE_T len) const;
+  bool    IsAligned(const BYTE_T *p) const;
 
 
   //
@@ -94,9 +120,65 @@ class DiskSystem {
 		const Block &blocks,
 		double &reqtime);
 
+  // How the data and bitmap files are read and written, pread by
+  // default, or stdio, or through a mapping of each file.
+  // Switching reopens them; the simulated times do not change.
+  // returns ERROR_NOERROR, ERROR_BADCONFIG for an unknown type, or
+  // ERROR_NOFILE
+  // queuedepth is the most requests the uring backend has in flight
+  ERROR_T SetStorage(const DiskStorageType type, const SIZE_T queuedepth=STORAGE_QUEUE_DEPTH);
+  DiskStorageType GetStorage() const;
+  // Direct I/O opens the data file with O_DIRECT, so that the only
+  // cache of its blocks is the BufferCache above.  The block size
+  // and offset must be multiples of the file system's direct I/O
+  // alignment, and from then on the BufferPool hands out buffers
+  // aligned to it.  A block whose buffer is not aligned anyway is
+  // read and written through an aligned copy.  Only the pread and
+  // uring backends have it.
+  // returns ERROR_NOERROR, ERROR_BADCONFIG if the disk or backend
+  // does not allow it, or ERROR_NOFILE
+  ERROR_T SetDirectIO(const bool enable);
+  bool    GetDirectIO() const { return directalign>0; }
+
+  // Tells the backend how the data file is about to be read, and
+  // forces what has been written out to it
+  void    Advise(const DiskStorageAdvice advice);
+  ERROR_T Sync();
+
+  // Asynchronous requests.  Each is timed by the model, and so
+  // advances the head, when it is submitted, just as Read and
+  // Write are; only the real I/O underneath is left in flight,
+  // several at a time with the uring backend.  The ticket names
+  // the request to Wait, which must be called once for each.  A
+  // read goes straight into the block, which is sized here and
+  // must not be touched until the read has been waited for.  A
+  // write copies the blocks, so they may change at once.
+  // Requests are not ordered against each other, or against Read
+  // and Write, so a block should not be read while a write of it
+  // is in flight.
+  // returns ERROR_NOERROR or nonzero error codes
+  ERROR_T SubmitRead(const SIZE_T inoffblock,
+		     Block &block,
+		     double &reqtime,
+		     SIZE_T &ticket);
+  ERROR_T SubmitWrite(const SIZE_T inoffblock,
+		      const SIZE_T numblock,
+		      const vector<Block> &blocks,
+		      double &reqtime,
+		      SIZE_T &ticket);
+  // Returns the result of the request once it is done
+  ERROR_T Wait(const SIZE_T ticket);
+  SIZE_T  GetNumOutstanding() const { return pending.size(); }
+
   SIZE_T GetBlockSize() const;
   SIZE_T GetNumBlocks() const;
 
+  // Where a block lives, and the track the head was left on,
+  // using the same geometry as the access time model
+  SIZE_T GetTrack(const SIZE_T block) const;
+  SIZE_T GetSector(const SIZE_T block) const;
+  SIZE_T GetHeadTrack() const;
+
   //
   // These are notification functions that should be called when
   // a block is allocated or deallocated.  They keep the bitmap updated
@@ -0,0 +1,132 @@
+#include <algorithm>
+
+#include "mrc.h"
+
+
+// Smallest Fenwick tree, in access times
+const SIZE_T MRC_MIN_TIMES=1024;
+
+
+MissRatioCurve::MissRatioCurve(const double r)
+{
+  rate = r>0 && r<1 ? r : 1.0;
+  threshold = (unsigned long long)(rate*4294967296.0);
+  Clear();
+}
+
+void MissRatioCurve::Clear()
+{
+  lastaccess.clear();
+  marks.assign(MRC_MIN_TIMES+1,0);
+  clock=0;
+  histogram.clear();
+  coldmisses=0;
+  sampled=accesses=0;
+}
+
+
+void MissRatioCurve::Mark(SIZE_T time, const int delta)
+{
+  for (; time<marks.size(); time+=time&(~time+1)) {
+    marks[time]+=delta;
+  }
+}
+
+// Number of marked times in [1,time]
+SIZE_T MissRatioCurve::Count(SIZE_T time) const
+{
+  SIZE_T total=0;
+
+  for (; time>0; time-=time&(~time+1)) {
+    total+=marks[time];
+  }
+  return total;
+}
+
+//
+// Out of access times.  Only the latest access of each block is
+// marked, so those are renumbered 1..n, keeping their order, and the
+// tree is rebuilt with room to spare.
+//
+void MissRatioCurve::Renumber()
+{
+  vector<pair<SIZE_T,SIZE_T> > live;
+
+  for (unordered_map<SIZE_T, SIZE_T, cache_hash>::const_iterator i=lastaccess.begin();
+       i!=lastaccess.end();
+       ++i) {
+    live.push_back(pair<SIZE_T,SIZE_T>((*i).second,(*i).first));
+  }
+  sort(live.begin(),live.end());
+
+  SIZE_T size=2*live.size();
+  marks.assign((size<MRC_MIN_TIMES ? MRC_MIN_TIMES : size)+1,0);
+  for (clock=0; clock<live.size(); clock++) {
+    lastaccess[live[clock].second]=clock+1;
+    Mark(clock+1,1);
+  }
+}
+
+
+void MissRatioCurve::Access(const SIZE_T blocknum)
+{
+  accesses++;
+
+  // top half of a multiplicative hash, compared with rate*2^32
+  unsigned long long h=(blocknum*0x9E3779B97F4A7C15ULL)>>32;
+  if (h>=threshold) {
+    return;
+  }
+  sampled++;
+
+  if (clock+1>=marks.size()) {
+    Renumber();
+  }
+  SIZE_T now=++clock;
+
+  unordered_map<SIZE_T, SIZE_T, cache_hash>::iterator last=lastaccess.find(blocknum);
+
+  if (last==lastaccess.end()) {
+    coldmisses++;
+    lastaccess[blocknum]=now;
+  } else {
+    // distinct blocks marked strictly between the two accesses
+    SIZE_T distance=Count(now-1)-Count((*last).second);
+    if (distance>=histogram.size()) {
+      histogram.resize(distance+1,0);
+    }
+    histogram[distance]++;
+    Mark((*last).second,-1);
+    (*last).second=now;
+  }
+  Mark(now,1);
+}
+
+
+SIZE_T MissRatioCurve::GetFootprint() const
+{
+  return (SIZE_T)(lastaccess.size()/rate+0.5);
+}
+
+double MissRatioCurve::GetMissRatio(const SIZE_T cachesize) const
+{
+  if (sampled==0) {
+    return 0;
+  }
+
+  // a sampled distance d stands for d/rate blocks in the full
+  // stream, which hits when that is below the cache size
+  double misses=coldmisses;
+
+  for (SIZE_T d=0; d<histogram.size(); d++) {
+    if (d>=cachesize*rate) {
+      misses+=histogram[d];
+    }
+  }
+  return misses/sampled;
+}
+
+double MissRatioCurve::GetMisses(const SIZE_T cachesize) const
+{
+  return GetMissRatio(cachesize)*accesses;
+}
@@ -0,0 +1,65 @@
+#ifndef _mrc
+#define _mrc
+
+#include <iostream>
+#include <vector>
+#include <unordered_map>
+
+#include "global.h"
+#include "replacement.h"
+
+using namespace std;
+
+
+//
+// Estimates the miss ratio of an LRU cache of any size from one
+// pass over the access stream (SHARDS).
+//
+// A block is sampled when a hash of its number falls below the
+// sampling rate, so either every access to a block is seen or none
+// is.  For each sampled access the reuse distance, the number of
+// distinct sampled blocks touched since the previous access to the
+// same block, is found with a Fenwick tree over access times that
+// marks only the latest access of each block.  Divided by the rate,
+// that is the distance in the full stream, and an LRU cache of
+// cachesize blocks hits exactly when the distance is below
+// cachesize.
+//
+// Memory and time per access are proportional to the number of
+// sampled blocks, so a rate of 0.01 tracks a hundredth of the
+// footprint.  A rate of one gives the exact LRU curve.
+//
+class MissRatioCurve {
+ private:
+  double rate;
+  unsigned long long threshold;
+  unordered_map<SIZE_T, SIZE_T, cache_hash> lastaccess;
+  vector<SIZE_T> marks;          // Fenwick tree over access times
+  SIZE_T clock;
+  vector<SIZE_T> histogram;      // sampled reuse distance counts
+  SIZE_T coldmisses;
+  SIZE_T sampled, accesses;
+
+  void   Mark(SIZE_T time, const int delta);
+  SIZE_T Count(SIZE_T time) const;
+  void   Renumber();
+ public:
+  // rate is clamped to (0,1]
+  MissRatioCurve(const double rate=1.0);
+
+  void   Access(const SIZE_T blocknum);
+  void   Clear();
+
+  double GetSampleRate() const { return rate; }
+  SIZE_T GetNumAccesses() const { return accesses; }
+  SIZE_T GetNumSampled() const { return sampled; }
+  // Estimated number of distinct blocks touched
+  SIZE_T GetFootprint() const;
+  // Estimated misses and miss ratio for an LRU cache of cachesize
+  // blocks, over the accesses seen so far
+  double GetMisses(const SIZE_T cachesize) const;
+  double GetMissRatio(const SIZE_T cachesize) const;
+};
+
+
+#endif
@@ -22,20 +22,25 @@ int main(int argc, char *argv[])
   DiskSystem disk(argv[2]);
   BufferCache cache(&disk,cachesize);
 
-  SIZE_T blocksize = disk.GetBlockSize();
-
   cache.Attach();
 
-  for (unsigned i=blocknum;i<(blocknum+numblocks);i++) { 
-    Block block(blocksize);
+  // a cache full at a time, so runs of misses are read together
+  for (SIZE_T i=blocknum;i<(blocknum+numblocks);i+=cachesize) { 
+    vector<SIZE_T> blocknums;
+    vector<Block> blocks;
     ERROR_T rc;
-    rc=cache.ReadBlock(i,block);
+    for (SIZE_T j=i;j<(blocknum+numblocks) && j<i+cachesize;j++) { 
+      blocknums.push_back(j);
+    }
+    rc=cache.ReadBlocks(blocknums,blocks);
     if (rc!=ERROR_NOERROR) { 
-      cerr << "Error " << rc <<" occured when reading block "<< i << endl;
+      cerr << "Error " << rc <<" occured when reading blocks "<< i << " to " << blocknums.back() << endl;
       return -1;
     }
-    for (SIZE_T j=0;j<block.length;j++) { 
-      cout << block.data[j];
+    for (SIZE_T k=0;k<blocks.size();k++) { 
+      for (SIZE_T j=0;j<blocks[k].length;j++) { 
+	cout << blocks[k].data[j];
+      }
     }
   }
 
@@ -49,6 +54,13 @@ int main(int argc, char *argv[])
   cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
   cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
   cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+  cerr << "numreadaheads   = "<<cache.GetNumReadAheads()<<endl;
+  cerr << "readaheadblocks = "<<cache.GetNumReadAheadBlocks()<<endl;
+  cerr << "readaheadhits   = "<<cache.GetNumReadAheadHits()<<endl;
+  cerr << "readaheadwaste  = "<<cache.GetNumReadAheadWaste()<<endl;
+  cerr << "sharedreads     = "<<cache.GetNumSharedReads()<<endl;
+  cerr << "batchmisses     = "<<cache.GetNumBatchMisses()<<endl;
+  cerr << "batchruns       = "<<cache.GetNumBatchRuns()<<endl;
   cerr << endl;
 
   cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
@@ -0,0 +1,591 @@
+#include <string.h>
+
+#include "replacement.h"
+
+
+void FrameList::PushFront(BufferFrame *f)
+{
+  f->prev=0;
+  f->next=head;
+  if (head) {
+    head->prev=f;
+  }
+  head=f;
+  if (!tail) {
+    tail=f;
+  }
+  size++;
+}
+
+void FrameList::InsertBefore(BufferFrame *pos, BufferFrame *f)
+{
+  if (!pos || pos==head) {
+    PushFront(f);
+    return;
+  }
+  f->next=pos;
+  f->prev=pos->prev;
+  pos->prev->next=f;
+  pos->prev=f;
+  size++;
+}
+
+void FrameList::Remove(BufferFrame *f)
+{
+  if (f->prev) {
+    f->prev->next=f->next;
+  } else {
+    head=f->next;
+  }
+  if (f->next) {
+    f->next->prev=f->prev;
+  } else {
+    tail=f->prev;
+  }
+  f->prev=f->next=0;
+  size--;
+}
+
+BufferFrame *FrameList::OldestEvictable(const bool clean) const
+{
+  // a clean frame is only looked for in the oldest quarter, so
+  // that preferring clean frames never gives up hot ones
+  SIZE_T limit = clean ? size/4+1 : size;
+  SIZE_T n=0;
+
+  for (BufferFrame *f=tail; f && n<limit; f=f->prev, n++) {
+    if (f->Evictable(clean)) {
+      return f;
+    }
+  }
+  return 0;
+}
+
+
+void GhostList::PushFront(const SIZE_T blocknum)
+{
+  Erase(blocknum);
+  order.push_front(blocknum);
+  where[blocknum]=order.begin();
+}
+
+void GhostList::Erase(const SIZE_T blocknum)
+{
+  unordered_map<SIZE_T, list<SIZE_T>::iterator, cache_hash>::iterator i=where.find(blocknum);
+
+  if (i!=where.end()) {
+    order.erase((*i).second);
+    where.erase(i);
+  }
+}
+
+void GhostList::PopBack()
+{
+  if (!order.empty()) {
+    where.erase(order.back());
+    order.pop_back();
+  }
+}
+
+
+
+//
+// Least recently used
+//
+class LRUPolicy : public ReplacementPolicy {
+ private:
+  FrameList frames;
+ public:
+  LRUPolicy(const SIZE_T cs) : ReplacementPolicy(cs) {}
+
+  void Insert(BufferFrame *f) { frames.PushFront(f); }
+  void Touch(BufferFrame *f) { frames.MoveToFront(f); }
+  void Remove(BufferFrame *f, const bool evicted) { frames.Remove(f); }
+  BufferFrame *Victim(const bool clean) { return frames.OldestEvictable(clean); }
+  void Clear() { frames=FrameList(); }
+  const char *GetName() const { return "lru"; }
+};
+
+
+
+//
+// CLOCK (second chance)
+//
+// The frames form a ring walked from head to tail.  New frames go
+// just behind the hand so they are the last to be examined.
+//
+class ClockPolicy : public ReplacementPolicy {
+ private:
+  FrameList   ring;
+  BufferFrame *hand;
+
+  void Advance() { hand = (hand && hand->next) ? hand->next : ring.head; }
+ public:
+  ClockPolicy(const SIZE_T cs) : ReplacementPolicy(cs), hand(0) {}
+
+  void Insert(BufferFrame *f)
+  {
+    f->referenced=true;
+    ring.InsertBefore(hand,f);
+    if (!hand) {
+      hand=f;
+    }
+  }
+  void Touch(BufferFrame *f) { f->referenced=true; }
+  void Remove(BufferFrame *f, const bool evicted)
+  {
+    if (f==hand) {
+      Advance();
+      if (f==hand) {
+	hand=0;
+      }
+    }
+    ring.Remove(f);
+  }
+  BufferFrame *Victim(const bool clean)
+  {
+    // at most two sweeps: one to clear bits, one to find a clear one
+    // only a quarter of a sweep when looking for a clean frame
+    SIZE_T limit = clean ? ring.size/4+1 : 2*ring.size;
+
+    for (SIZE_T i=0; hand && i<=limit; i++) {
+      if (hand->Evictable(clean)) {
+	if (!hand->referenced) {
+	  return hand;
+	}
+	hand->referenced=false;
+      }
+      Advance();
+    }
+    return 0;
+  }
+  void Clear() { ring=FrameList(); hand=0; }
+  const char *GetName() const { return "clock"; }
+};
+
+
+
+//
+// 2Q (Johnson and Shasha, full version)
+//
+// First-time blocks enter the A1in FIFO.  When they fall out of it
+// they are remembered in the A1out ghost list, and a miss on a block
+// in A1out goes straight to the Am LRU list.  Hits in A1in are not
+// promoted, so a single sweep never displaces Am.
+//
+class TwoQPolicy : public ReplacementPolicy {
+ private:
+  enum { Q_A1IN=1, Q_AM=2 };
+  FrameList a1in, am;
+  GhostList a1out;
+
+  SIZE_T Kin() const { return cachesize/4 > 0 ? cachesize/4 : 1; }
+  SIZE_T Kout() const { return cachesize/2 > 0 ? cachesize/2 : 1; }
+ public:
+  TwoQPolicy(const SIZE_T cs) : ReplacementPolicy(cs) {}
+
+  void Insert(BufferFrame *f)
+  {
+    if (a1out.Contains(f->blocknum)) {
+      a1out.Erase(f->blocknum);
+      f->queue=Q_AM;
+      am.PushFront(f);
+    } else {
+      f->queue=Q_A1IN;
+      a1in.PushFront(f);
+    }
+  }
+  void Touch(BufferFrame *f)
+  {
+    if (f->queue==Q_AM) {
+      am.MoveToFront(f);
+    }
+  }
+  void Remove(BufferFrame *f, const bool evicted)
+  {
+    if (f->queue==Q_AM) {
+      am.Remove(f);
+    } else {
+      a1in.Remove(f);
+      if (evicted) {
+	a1out.PushFront(f->blocknum);
+	while (a1out.Size()>Kout()) {
+	  a1out.PopBack();
+	}
+      }
+    }
+  }
+  BufferFrame *Victim(const bool clean)
+  {
+    BufferFrame *f=0;
+
+    if (a1in.size>Kin()) {
+      f=a1in.OldestEvictable(clean);
+    }
+    if (!f) {
+      f=am.OldestEvictable(clean);
+    }
+    if (!f) {
+      f=a1in.OldestEvictable(clean);
+    }
+    return f;
+  }
+  void Clear() { a1in=FrameList(); am=FrameList(); a1out.Clear(); }
+  const char *GetName() const { return "2q"; }
+};
+
+
+
+//
+// ARC (Megiddo and Modha)
+//
+// T1 holds blocks seen once recently, T2 blocks seen at least twice.
+// B1 and B2 are their ghosts.  p is the adaptive target size of T1,
+// moved toward whichever ghost list is getting hits.
+//
+class ARCPolicy : public ReplacementPolicy {
+ private:
+  enum { Q_T1=1, Q_T2=2 };
+  FrameList t1, t2;
+  GhostList b1, b2;
+  double    p;
+  bool      incoming_in_b2;
+
+ public:
+  ARCPolicy(const SIZE_T cs) : ReplacementPolicy(cs), p(0), incoming_in_b2(false) {}
+
+  void SetCacheSize(const SIZE_T size)
+  {
+    cachesize=size;
+    // the target for t1 stays within the cache
+    if (p>size) {
+      p=size;
+    }
+  }
+
+  void Miss(const SIZE_T blocknum)
+  {
+    double c=cachesize;
+
+    incoming_in_b2=false;
+    if (b1.Contains(blocknum)) {
+      double delta = b1.Size()>=b2.Size() ? 1 : (double)b2.Size()/b1.Size();
+      p = p+delta > c ? c : p+delta;
+    } else if (b2.Contains(blocknum)) {
+      double delta = b2.Size()>=b1.Size() ? 1 : (double)b1.Size()/b2.Size();
+      p = p-delta < 0 ? 0 : p-delta;
+      incoming_in_b2=true;
+    } else {
+      // keep the directory within 2c entries
+      if (t1.size+b1.Size()>=cachesize && b1.Size()>0) {
+	b1.PopBack();
+      } else if (t1.size+t2.size+b1.Size()+b2.Size()>=2*cachesize && b2.Size()>0) {
+	b2.PopBack();
+      }
+    }
+  }
+  void Insert(BufferFrame *f)
+  {
+    if (b1.Contains(f->blocknum) || b2.Contains(f->blocknum)) {
+      b1.Erase(f->blocknum);
+      b2.Erase(f->blocknum);
+      f->queue=Q_T2;
+      t2.PushFront(f);
+    } else {
+      f->queue=Q_T1;
+      t1.PushFront(f);
+    }
+  }
+  void Touch(BufferFrame *f)
+  {
+    if (f->queue==Q_T1) {
+      t1.Remove(f);
+      f->queue=Q_T2;
+      t2.PushFront(f);
+    } else {
+      t2.MoveToFront(f);
+    }
+  }
+  void Remove(BufferFrame *f, const bool evicted)
+  {
+    if (f->queue==Q_T1) {
+      t1.Remove(f);
+      if (evicted) {
+	b1.PushFront(f->blocknum);
+      }
+    } else {
+      t2.Remove(f);
+      if (evicted) {
+	b2.PushFront(f->blocknum);
+      }
+    }
+  }
+  BufferFrame *Victim(const bool clean)
+  {
+    BufferFrame *f=0;
+
+    if (t1.size>0 && ((incoming_in_b2 && t1.size==(SIZE_T)p) || t1.size>p)) {
+      f=t1.OldestEvictable(clean);
+    }
+    if (!f) {
+      f=t2.OldestEvictable(clean);
+    }
+    if (!f) {
+      f=t1.OldestEvictable(clean);
+    }
+    return f;
+  }
+  void Clear() { t1=FrameList(); t2=FrameList(); b1.Clear(); b2.Clear(); p=0; }
+  const char *GetName() const { return "arc"; }
+};
+
+
+
+//
+// LIRS (Jiang and Zhang)
+//
+// Blocks with a low inter-reference recency (LIR) own most of the
+// cache.  The rest is a small queue Q of resident HIR blocks, which
+// is where victims come from.  The stack S orders blocks by recency
+// and also remembers non-resident HIR blocks, so that a block that
+// comes back soon enough can be promoted to LIR.
+//
+class LIRSPolicy : public ReplacementPolicy {
+ private:
+  enum { LIR, HIR_RESIDENT, HIR_NONRESIDENT };
+  struct Entry {
+    int          state;
+    bool         ins, inq, innonres;
+    list<SIZE_T>::iterator sit, qit, nit;
+    BufferFrame *frame;
+    Entry() : state(HIR_NONRESIDENT), ins(false), inq(false), innonres(false), frame(0) {}
+  };
+  typedef unordered_map<SIZE_T, Entry, cache_hash> EntryMap;
+
+  EntryMap     entries;
+  list<SIZE_T> s;         // front is top of stack
+  list<SIZE_T> q;         // front is newest, back is next victim
+  list<SIZE_T> nonres;    // non-resident entries still in s, front is newest
+  SIZE_T       numlir;
+
+  SIZE_T LHIRS() const { return cachesize/100 > 0 ? cachesize/100 : 1; }
+  SIZE_T LLIRS() const { return cachesize>LHIRS() ? cachesize-LHIRS() : 1; }
+
+  void PushS(const SIZE_T b, Entry &e)
+  {
+    if (e.ins) {
+      s.erase(e.sit);
+    }
+    s.push_front(b);
+    e.sit=s.begin();
+    e.ins=true;
+  }
+  void PushQ(const SIZE_T b, Entry &e)
+  {
+    if (e.inq) {
+      q.erase(e.qit);
+    }
+    q.push_front(b);
+    e.qit=q.begin();
+    e.inq=true;
+  }
+  void DropQ(Entry &e)
+  {
+    if (e.inq) {
+      q.erase(e.qit);
+      e.inq=false;
+    }
+  }
+  void DropNonResident(Entry &e)
+  {
+    if (e.innonres) {
+      nonres.erase(e.nit);
+      e.innonres=false;
+    }
+  }
+  void Forget(const SIZE_T b)
+  {
+    EntryMap::iterator i=entries.find(b);
+    if (i==entries.end()) {
+      return;
+    }
+    if ((*i).second.ins) {
+      s.erase((*i).second.sit);
+    }
+    DropQ((*i).second);
+    DropNonResident((*i).second);
+    entries.erase(i);
+  }
+  // Remove HIR blocks from the bottom of the stack so that it
+  // always ends in a LIR block
+  void Prune()
+  {
+    while (!s.empty()) {
+      SIZE_T b=s.back();
+      Entry &e=entries[b];
+      if (e.state==LIR) {
+	break;
+      }
+      s.pop_back();
+      e.ins=false;
+      if (e.state==HIR_NONRESIDENT) {
+	DropNonResident(e);
+	entries.erase(b);
+      }
+    }
+  }
+  // The bottom LIR block becomes a resident HIR block
+  void DemoteBottom()
+  {
+    if (s.empty()) {
+      return;
+    }
+    SIZE_T b=s.back();
+    Entry &e=entries[b];
+    s.pop_back();
+    e.ins=false;
+    e.state=HIR_RESIDENT;
+    numlir--;
+    PushQ(b,e);
+    Prune();
+  }
+  void MakeLIR(const SIZE_T b, Entry &e)
+  {
+    DropQ(e);
+    DropNonResident(e);
+    e.state=LIR;
+    numlir++;
+    PushS(b,e);
+  }
+ public:
+  LIRSPolicy(const SIZE_T cs) : ReplacementPolicy(cs), numlir(0) {}
+
+  void Insert(BufferFrame *f)
+  {
+    SIZE_T b=f->blocknum;
+    Entry &e=entries[b];
+
+    e.frame=f;
+    if (numlir<LLIRS()) {
+      MakeLIR(b,e);
+    } else if (e.ins && e.state==HIR_NONRESIDENT) {
+      MakeLIR(b,e);
+      DemoteBottom();
+    } else {
+      e.state=HIR_RESIDENT;
+      PushS(b,e);
+      PushQ(b,e);
+    }
+  }
+  void Touch(BufferFrame *f)
+  {
+    SIZE_T b=f->blocknum;
+    Entry &e=entries[b];
+
+    if (e.state==LIR) {
+      bool wasbottom = s.back()==b;
+      PushS(b,e);
+      if (wasbottom) {
+	Prune();
+      }
+    } else if (e.ins) {
+      MakeLIR(b,e);
+      DemoteBottom();
+    } else {
+      PushS(b,e);
+      PushQ(b,e);
+    }
+  }
+  void Remove(BufferFrame *f, const bool evicted)
+  {
+    SIZE_T b=f->blocknum;
+    EntryMap::iterator i=entries.find(b);
+
+    if (i==entries.end()) {
+      return;
+    }
+    Entry &e=(*i).second;
+    if (e.state==HIR_RESIDENT && e.ins && evicted) {
+      // keep its history on the stack
+      DropQ(e);
+      e.state=HIR_NONRESIDENT;
+      e.frame=0;
+      nonres.push_front(b);
+      e.nit=nonres.begin();
+      e.innonres=true;
+      // bound the non-resident history to the cache size
+      while (nonres.size()>cachesize) {
+	Forget(nonres.back());
+      }
+    } else {
+      if (e.state==LIR) {
+	numlir--;
+      }
+      Forget(b);
+      Prune();
+    }
+  }
+  BufferFrame *Victim(const bool clean)
+  {
+    for (list<SIZE_T>::reverse_iterator i=q.rbegin(); i!=q.rend(); ++i) {
+      BufferFrame *f=entries[*i].frame;
+      if (f->Evictable(clean)) {
+	return f;
+      }
+    }
+    // Only LIR blocks are available, so give up the coldest one,
+    // but not just to find a clean one
+    if (clean) {
+      return 0;
+    }
+    for (list<SIZE_T>::reverse_iterator i=s.rbegin(); i!=s.rend(); ++i) {
+      Entry &e=entries[*i];
+      if (e.state==LIR && e.frame->Evictable(clean)) {
+	return e.frame;
+      }
+    }
+    return 0;
+  }
+  void Clear() { entries.clear(); s.clear(); q.clear(); nonres.clear(); numlir=0; }
+  const char *GetName() const { return "lirs"; }
+};
+
+
+
+ReplacementPolicy *MakeReplacementPolicy(const ReplacementPolicyType type,
+					 const SIZE_T cachesize)
+{
+  switch (type) {
+  case POLICY_LRU:
+    return new LRUPolicy(cachesize);
+  case POLICY_CLOCK:
+    return new ClockPolicy(cachesize);
+  case POLICY_2Q:
+    return new TwoQPolicy(cachesize);
+  case POLICY_ARC:
+    return new ARCPolicy(cachesize);
+  case POLICY_LIRS:
+    return new LIRSPolicy(cachesize);
+  default:
+    return 0;
+  }
+}
+
+
+ERROR_T ParseReplacementPolicy(const char *name, ReplacementPolicyType &type)
+{
+  if (!strcasecmp(name,"lru")) {
+    type=POLICY_LRU;
+  } else if (!strcasecmp(name,"clock")) {
+    type=POLICY_CLOCK;
+  } else if (!strcasecmp(name,"2q")) {
+    type=POLICY_2Q;
+  } else if (!strcasecmp(name,"arc")) {
+    type=POLICY_ARC;
+  } else if (!strcasecmp(name,"lirs")) {
+    type=POLICY_LIRS;
+  } else {
+    return ERROR_BADCONFIG;
+  }
+  return ERROR_NOERROR;
+}
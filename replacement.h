@@ -0,0 +1,162 @@
+#ifndef _replacement
+#define _replacement
+
+#include <list>
+#include <unordered_map>
+
+#include "global.h"
+#include "block.h"
+
+using namespace std;
+
+struct cache_hash {
+  size_t operator()(const SIZE_T s) const {
+    return s;
+  }
+};
+
+
+//
+// What a block holds, as told to the cache by its user.  The upper
+// levels of an index are touched by every operation, so the cache
+// keeps a share of itself for them.
+//
+enum AccessHint {HINT_NONE, HINT_SUPERBLOCK, HINT_ROOT, HINT_INTERIOR, HINT_LEAF};
+
+inline bool IsUpperLevel(const AccessHint hint)
+{
+  return hint==HINT_SUPERBLOCK || hint==HINT_ROOT || hint==HINT_INTERIOR;
+}
+
+
+//
+// A cached block plus the bookkeeping the replacement policy keeps
+// on it.  prev and next thread the frame onto one of the policy's
+// lists, queue says which one, and referenced is the CLOCK bit.
+// A frame with a nonzero pincount must never be chosen as a victim,
+// and when the cache asks for a clean victim a dirty one is passed
+// over too.
+// readyat is the simulated time at which the disk read that filled
+// the frame completes.  prefetched and readahead are set until the
+// first demand access of a frame that was filled by a prefetch or by
+// read-ahead.  lastuse orders the frames of a cache by recency.
+// hint is the last hint given for the block, and reserved is set
+// while the frame holds one of the cache's slots for upper levels,
+// which also keeps it from being chosen as a victim.  scan is set
+// while the frame sits on the cache's probation list for scanned
+// blocks instead of with the policy.  slot is the piece of the
+// cache's frame arena that block borrows as its data, if any.
+//
+struct BufferFrame {
+  SIZE_T       blocknum;
+  Block        block;
+  SIZE_T       pincount;
+  SIZE_T       sharers;      // those of the pins held by BlockRefs
+  double       readyat;
+  bool         prefetched;
+  bool         readahead;
+  SIZE_T       lastuse;
+  AccessHint   hint;
+  bool         reserved;
+  bool         scan;
+  BYTE_T      *slot;
+  BufferFrame *prev;
+  BufferFrame *next;
+  int          queue;
+  bool         referenced;
+  SIZE_T       ioticket;     // nonzero while a read into block is in flight
+  SIZE_T       dirtystamp;   // changes each time the block is written
+
+  BufferFrame() : blocknum(0), pincount(0), sharers(0), readyat(0), prefetched(false), readahead(false), lastuse(0),
+		  hint(HINT_NONE), reserved(false), scan(false), slot(0), prev(0), next(0), queue(0), referenced(false),
+		  ioticket(0), dirtystamp(0) {}
+
+  bool Evictable(const bool clean=false) const { return pincount==0 && !reserved && !(clean && block.dirty); }
+};
+
+
+//
+// Intrusive doubly linked list of frames.  head is the most
+// recently inserted end, tail the oldest.
+//
+struct FrameList {
+  BufferFrame *head;
+  BufferFrame *tail;
+  SIZE_T       size;
+
+  FrameList() : head(0), tail(0), size(0) {}
+
+  void PushFront(BufferFrame *f);
+  void InsertBefore(BufferFrame *pos, BufferFrame *f);
+  void Remove(BufferFrame *f);
+  void MoveToFront(BufferFrame *f) { Remove(f); PushFront(f); }
+  // oldest frame that may be evicted, or zero
+  // with clean set, a clean one from the oldest quarter
+  BufferFrame *OldestEvictable(const bool clean=false) const;
+};
+
+
+//
+// List of block numbers that are no longer resident, used by the
+// policies that remember recently evicted blocks.  Front is newest.
+//
+class GhostList {
+ private:
+  list<SIZE_T> order;
+  unordered_map<SIZE_T, list<SIZE_T>::iterator, cache_hash> where;
+ public:
+  bool   Contains(const SIZE_T blocknum) const { return where.count(blocknum)!=0; }
+  void   PushFront(const SIZE_T blocknum);
+  void   Erase(const SIZE_T blocknum);
+  void   PopBack();
+  SIZE_T Size() const { return where.size(); }
+  void   Clear() { order.clear(); where.clear(); }
+};
+
+
+enum ReplacementPolicyType {POLICY_LRU, POLICY_CLOCK, POLICY_2Q, POLICY_ARC, POLICY_LIRS};
+
+
+//
+// Replacement policy interface used by BufferCache
+//
+// On a miss the cache calls Miss(), then, if the cache is full,
+// Victim() followed by Remove(victim,true), and finally Insert() on
+// the frame holding the new block.  A hit calls Touch().  A block
+// that leaves the cache for any other reason gets Remove(f,false).
+//
+class ReplacementPolicy {
+ protected:
+  SIZE_T cachesize;
+ public:
+  ReplacementPolicy(const SIZE_T cachesize) : cachesize(cachesize) {}
+  virtual ~ReplacementPolicy() {}
+
+  virtual void Miss(const SIZE_T blocknum) {}
+  virtual void Insert(BufferFrame *f)=0;
+  virtual void Touch(BufferFrame *f)=0;
+  virtual void Remove(BufferFrame *f, const bool evicted)=0;
+  // returns zero if no resident frame is evictable
+  // with clean set, only frames that are not dirty and are near
+  // the eviction end are considered
+  virtual BufferFrame *Victim(const bool clean=false)=0;
+  // forget all frames and history
+  virtual void Clear()=0;
+  // The cache has a new size.  Resident frames stay, and the cache
+  // evicts down to a smaller size itself.
+  virtual void SetCacheSize(const SIZE_T size) { cachesize=size; }
+
+  virtual const char *GetName() const=0;
+};
+
+
+// returns zero for an unknown type
+ReplacementPolicy *MakeReplacementPolicy(const ReplacementPolicyType type,
+					 const SIZE_T cachesize);
+
+// accepts lru, clock, 2q, arc, or lirs
+// returns ERROR_NOERROR or ERROR_BADCONFIG
+ERROR_T ParseReplacementPolicy(const char *name, ReplacementPolicyType &type);
+
+
+#endif
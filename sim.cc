@@ -1,17 +1,95 @@
 #include <iostream>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include <string>
 #include <strstream>
 #include <fstream>
+#include <vector>
+#include <algorithm>
 #include "btree.h"
+#include "bufpool.h"
 
 
 using namespace std;
 
 void usage()
 {
-  cerr << "usage: sim filestem cachesize < specfile \n";
+  cerr << "usage: sim [-p lru|clock|2q|arc|lirs] [-f high,low] [-t] [-s shards] [-w] [-e] [-m rate] [-u share] [-z blocks] [-a normal|thp|huge] [-b statsfile] [-r hitrate[,maxbytes]] [-d pread|stdio|mmap|mmap-sync|uring[,depth]] [-o] filestem cachesize < specfile \n";
+}
+
+
+static const char *NodeTypeName(const int nodetype)
+{
+  switch (nodetype) {
+  case BTREE_SUPERBLOCK:
+    return "superblock";
+  case BTREE_ROOT_NODE:
+    return "root";
+  case BTREE_INTERIOR_NODE:
+    return "interior";
+  case BTREE_LEAF_NODE:
+    return "leaf";
+  default:
+    return "free";
+  }
+}
+
+
+//
+// CSV of the counts of each block the run touched, with the type
+// of node the block holds at the end.  The counts are taken before
+// any header is read.  Headers are read through the cache while it
+// is attached, since nodes may not have been written back, and
+// from the disk after.
+//
+static ERROR_T WriteBlockStats(const char *filename, BufferCache &cache, DiskSystem &disk,
+			       const bool attached)
+{
+  ofstream out(filename);
+  vector<SIZE_T> blocks;
+  vector<BlockStats> stats;
+
+  if (!out) {
+    return ERROR_NOFILE;
+  }
+  for (SIZE_T i=0;i<cache.GetNumBlocks();i++) {
+    BlockStats b;
+    if (cache.GetBlockStats(i,b)==ERROR_NOERROR &&
+	(b.reads || b.writes || b.misses || b.evictions)) {
+      blocks.push_back(i);
+      stats.push_back(b);
+    }
+  }
+
+  out << "block,type,reads,writes,misses,evictions" << endl;
+  for (SIZE_T i=0;i<blocks.size();i++) {
+    NodeMetadata info;
+    BlockRef ref;
+    Block block;
+    double reqtime;
+    const Block *header=0;
+
+    info.nodetype=BTREE_UNALLOCATED_BLOCK;
+    if (attached) {
+      if (cache.ReadBlock(blocks[i],ref)==ERROR_NOERROR) {
+	header=&(*ref);
+      }
+    } else if (disk.Read(blocks[i],block,reqtime)==ERROR_NOERROR) {
+      header=&block;
+    }
+    if (header && header->length>=sizeof(info)) {
+      memcpy(&info,header->data,sizeof(info));
+    }
+    out << blocks[i] << ","
+	<< NodeTypeName(info.nodetype) << ","
+	<< stats[i].reads << ","
+	<< stats[i].writes << ","
+	<< stats[i].misses << ","
+	<< stats[i].evictions << endl;
+  }
+  return out ? ERROR_NOERROR : ERROR_NOFILE;
 }
 
 
@@ -20,13 +98,115 @@ int main(int argc, char *argv[])
 
   // CONFORMS to the interface of ref_impl.pl
 
-  if (argc != 3){
+  ReplacementPolicyType policy=POLICY_LRU;
+  double highwater=0;
+  double lowwater=0;
+  bool flusherthread=false;
+  SIZE_T numshards=1;
+  bool warm=false;
+  bool existing=false;
+  double mrcrate=0;
+  double uppershare=UPPER_SHARE;
+  SIZE_T tierblocks=0;
+  ArenaPageType arenapages=ARENA_PAGES_NORMAL;
+  const char *statsfile=0;
+  double tunetarget=-1;
+  unsigned tunemaxbytes=0;
+  DiskStorageType storage=STORAGE_PREAD;
+  unsigned queuedepth=STORAGE_QUEUE_DEPTH;
+  bool directio=false;
+  bool attached=false;
+  int opt;
+
+  while ((opt=getopt(argc,argv,"p:f:ts:wem:u:z:a:b:r:d:o"))!=-1) {
+    switch (opt) {
+    case 'p':
+      if (ParseReplacementPolicy(optarg,policy)!=ERROR_NOERROR) {
+	usage();
+	return 1;
+      }
+      break;
+    case 'f':
+      if (sscanf(optarg,"%lf,%lf",&highwater,&lowwater)!=2) {
+	usage();
+	return 1;
+      }
+      break;
+    case 't':
+      flusherthread=true;
+      break;
+    case 's':
+      numshards=atoi(optarg);
+      break;
+    case 'w':
+      warm=true;
+      break;
+    case 'e':
+      existing=true;
+      break;
+    case 'm':
+      mrcrate=atof(optarg);
+      if (mrcrate<=0 || mrcrate>1) {
+	usage();
+	return 1;
+      }
+      break;
+    case 'u':
+      uppershare=atof(optarg);
+      break;
+    case 'z':
+      tierblocks=atoi(optarg);
+      break;
+    case 'a':
+      if (string(optarg)=="normal") {
+	arenapages=ARENA_PAGES_NORMAL;
+      } else if (string(optarg)=="thp") {
+	arenapages=ARENA_PAGES_THP;
+      } else if (string(optarg)=="huge") {
+	arenapages=ARENA_PAGES_HUGE;
+      } else {
+	usage();
+	return 1;
+      }
+      break;
+    case 'b':
+      statsfile=optarg;
+      break;
+    case 'r':
+      if (sscanf(optarg,"%lf,%u",&tunetarget,&tunemaxbytes)<1 || tunetarget<0 || tunetarget>1) {
+	usage();
+	return 1;
+      }
+      break;
+    case 'd': {
+      string name(optarg);
+      size_t comma=name.find(',');
+      if (comma!=string::npos) {
+	queuedepth=atoi(name.c_str()+comma+1);
+	name.resize(comma);
+      }
+      if (ParseDiskStorage(name.c_str(),storage)!=ERROR_NOERROR || queuedepth==0) {
+	usage();
+	return 1;
+      }
+      break;
+    }
+    case 'o':
+      directio=true;
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  if (argc-optind != 2){
     usage();
     return 1;
   }
 
-  char *filestem=argv[1];
-  SIZE_T cachesize=atoi(argv[2]);
+  char *filestem=argv[optind];
+  SIZE_T cachesize=atoi(argv[optind+1]);
   SIZE_T superblocknum;
 
   FILE *file; 
@@ -38,15 +218,59 @@ int main(int argc, char *argv[])
   // run lots of operations
   // so we need to do this outside the loop
   DiskSystem disk(filestem);
-  BufferCache cache(&disk,cachesize);
-  // will be set on init
-  BTreeIndex *btree;
+  BufferCache cache(&disk,cachesize,policy,numshards);
+  // will be set on init, or at start with -e
+  BTreeIndex *btree=0;
 
+  if ((rc=disk.SetStorage(storage,queuedepth))!=ERROR_NOERROR) {
+    cerr << "Can't open disk storage due to error "<<rc<<"\n";
+    return -1;
+  }
+  if (directio && (rc=disk.SetDirectIO(true))!=ERROR_NOERROR) {
+    cerr << "Can't use direct I/O due to error "<<rc<<"\n";
+    return -1;
+  }
 
+  if (warm) {
+    // reload what the last run left in the cache, and save it again
+    // INIT rebuilds the tree, so without -e there is nothing to reload
+    if (!existing) {
+      remove((string(filestem)+".manifest").c_str());
+    }
+    cache.SetManifest(string(filestem)+".manifest");
+  }
+  // sampled reuse distances, for the estimates at the end
+  cache.SetMissRatioSampling(mrcrate);
+  cache.SetUpperShare(uppershare);
+  cache.SetCompressedTier(tierblocks);
+  cache.SetArenaPages(arenapages);
+  cache.SetBlockStats(statsfile!=0);
   if ((rc=cache.Attach())!=ERROR_NOERROR) {
     cerr << "Can't attach cache due to error "<<rc<<"\n";
     return -1;
   }
+  attached=true;
+  if (tunetarget>=0) {
+    // resize between operations toward the hit rate, within the cap
+    cache.SetAutoTune(tunetarget,tunemaxbytes);
+  }
+  // Simulated time from opening the tree to the end of the first
+  // operation on it, which is where a cold cache hurts.  Only a tree
+  // that was there before the run can have been cached by the last one.
+  double opened=cache.GetCurrentTime();
+  double firstop=-1;
+  if (existing) {
+    btree = new BTreeIndex(0,0,&cache);
+    if ((rc=btree->Attach(0))!=ERROR_NOERROR) {
+      cerr << "Can't attach btree due to error "<<rc<<"\n";
+      return -1;
+    }
+  }
+  cache.SetFlushWatermarks(highwater,lowwater);
+  if (flusherthread && (rc=cache.StartFlusher())!=ERROR_NOERROR) {
+    cerr << "Can't start flusher due to error "<<rc<<"\n";
+    return -1;
+  }
   
   file=stdin;
 
@@ -58,10 +282,13 @@ int main(int argc, char *argv[])
     istrstream is(line2.c_str(),line2.size());
     is >> action >> key >> value;
 
-    if (action == "INIT") {
+    if (action == "INIT" && existing && btree) {
+      // keep the tree opened at start
+      cout << "OK\n";
+    } else if (action == "INIT") {
       btree = new BTreeIndex(atoi(key.c_str()),atoi(value.c_str()),&cache);
-      if ((rc=btree->Attach(0, true))!=ERROR_NOERROR) {
-	cerr << "Can't attach btree with initialization due to error "<<rc<<"\n";
+      if ((rc=btree->Attach(0, !existing))!=ERROR_NOERROR) {
+	cerr << "Can't attach btree"<<(existing ? "" : " with initialization")<<" due to error "<<rc<<"\n";
 	cout << "FAIL\n";
       } else {
 	cout << "OK\n";
@@ -113,15 +340,107 @@ int main(int argc, char *argv[])
 	  cout <<"FAIL"<<endl;
 	  cerr <<"Can't detach cache due to error "<<rc<<endl;
 	} else {
+	  attached=false;
 	  delete btree;
+	  btree=0;
 	  cout << "OK\n";
 	}
       }
     }
+    if (tunetarget>=0 && (rc=cache.AutoTune())!=ERROR_NOERROR) {
+      cerr << "Can't resize cache due to error "<<rc<<endl;
+    }
+    if (existing && firstop<0 && action!="INIT") {
+      firstop=cache.GetCurrentTime()-opened;
+    }
   }
     
   fclose(file);
 
+  cerr << "Performance statistics:\n";
+  cerr << "policy          = "<<cache.GetPolicyName()<<endl;
+  cerr << "cachesize       = "<<cache.GetCacheSize()<<endl;
+  cerr << "numresizes      = "<<cache.GetNumResizes()<<endl;
+  cerr << "resizeevictions = "<<cache.GetNumResizeEvictions()<<endl;
+  cerr << "numreads        = "<<cache.GetNumReads()<<endl;
+  cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
+  cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
+  cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+  cerr << "numprefetches   = "<<cache.GetNumPrefetches()<<endl;
+  cerr << "prefetchhits    = "<<cache.GetNumPrefetchHits()<<endl;
+  cerr << "prefetchwaste   = "<<cache.GetNumPrefetchWaste()<<endl;
+  cerr << "numreadaheads   = "<<cache.GetNumReadAheads()<<endl;
+  cerr << "readaheadblocks = "<<cache.GetNumReadAheadBlocks()<<endl;
+  cerr << "readaheadhits   = "<<cache.GetNumReadAheadHits()<<endl;
+  cerr << "readaheadwaste  = "<<cache.GetNumReadAheadWaste()<<endl;
+  cerr << "numflushes      = "<<cache.GetNumFlushes()<<endl;
+  cerr << "flushedblocks   = "<<cache.GetNumFlushedBlocks()<<endl;
+  cerr << "flusherrors     = "<<cache.GetNumFlushErrors()<<endl;
+  cerr << "flushtime       = "<<cache.GetFlushTime()<<endl;
+  cerr << "scanblocks      = "<<cache.GetNumScanBlocks()<<endl;
+  cerr << "scanpromotions  = "<<cache.GetNumScanPromotions()<<endl;
+  if (cache.HasCompressedTier()) {
+    SIZE_T lookups=cache.GetNumTierLookups();
+    double rawbytes=cache.GetTierRawBytes();
+
+    cerr << "tierlookups     = "<<lookups<<endl;
+    cerr << "tierhits        = "<<cache.GetNumTierHits()<<endl;
+    cerr << "tierhitrate     = "<<(lookups ? (double)cache.GetNumTierHits()/lookups : 0)<<endl;
+    cerr << "tierstores      = "<<cache.GetNumTierStores()<<endl;
+    cerr << "tierratio       = "<<(rawbytes>0 ? cache.GetTierStoredBytes()/rawbytes : 0)<<endl;
+    cerr << "tiercputime     = "<<cache.GetTierCPUTime()<<endl;
+  }
+  cerr << "arenapages      = "<<(cache.GetArenaPages()==ARENA_PAGES_HUGE ? "huge" :
+				 cache.GetArenaPages()==ARENA_PAGES_THP ? "thp" : "normal")<<endl;
+  cerr << "arenaoverflows  = "<<cache.GetNumArenaOverflows()<<endl;
+  cerr << "blockcopies     = "<<Block::GetNumCopies()<<endl;
+  cerr << "blockallocs     = "<<Block::GetNumAllocs()<<endl;
+  cerr << "sharedreads     = "<<cache.GetNumSharedReads()<<endl;
+  cerr << "privatereads    = "<<cache.GetNumPrivateReads()<<endl;
+  cerr << "unshares        = "<<cache.GetNumUnshares()<<endl;
+  cerr << "poolhits        = "<<BufferPool::GetNumHits()<<endl;
+  cerr << "poolmisses      = "<<BufferPool::GetNumMisses()<<endl;
+  if (existing) {
+    cerr << "warmblocks      = "<<cache.GetNumWarmBlocks()<<endl;
+    cerr << "warmuptime      = "<<cache.GetWarmupTime()<<endl;
+    cerr << "first op time   = "<<firstop<<endl;
+    cerr << "startup time    = "<<(firstop<0 ? -1 : opened+firstop)<<endl;
+  }
+  cerr << endl;
+  cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+
+  if (cache.HasMissRatioCurve()) {
+    // LRU estimates at doubling sizes until the footprint fits,
+    // and at the size of this run for comparison
+    SIZE_T footprint=cache.GetEstimatedFootprint();
+    vector<SIZE_T> sizes;
+    SIZE_T size;
+
+    for (size=1; size<footprint; size*=2) {
+      sizes.push_back(size);
+    }
+    sizes.push_back(size);
+    sizes.push_back(cachesize);
+    sort(sizes.begin(),sizes.end());
+    sizes.erase(unique(sizes.begin(),sizes.end()),sizes.end());
+
+    cerr << endl;
+    cerr << "estimated footprint = "<<footprint<<endl;
+    cerr << "cachesize\tmissratio\tdisktime"<<endl;
+    for (vector<SIZE_T>::const_iterator i=sizes.begin(); i!=sizes.end(); ++i) {
+      cerr << *i << "\t"
+	   << cache.GetEstimatedMissRatio(*i) << "\t"
+	   << cache.GetEstimatedDiskTime(*i)
+	   << (*i==cachesize ? "\t(this run)" : "") << endl;
+    }
+  }
+
+  if (statsfile && (rc=WriteBlockStats(statsfile,cache,disk,attached))!=ERROR_NOERROR) {
+    cerr << "Can't write block statistics due to error "<<rc<<endl;
+    return -1;
+  }
+
+
   return 0;
 
 }
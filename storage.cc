@@ -0,0 +1,788 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "storage.h"
+
+
+static int FileAdvice(const DiskStorageAdvice advice)
+{
+  switch (advice) {
+  case ADVISE_RANDOM:
+    return POSIX_FADV_RANDOM;
+  case ADVISE_SEQUENTIAL:
+    return POSIX_FADV_SEQUENTIAL;
+  case ADVISE_WILLNEED:
+    return POSIX_FADV_WILLNEED;
+  case ADVISE_DONTNEED:
+    return POSIX_FADV_DONTNEED;
+  default:
+    return POSIX_FADV_NORMAL;
+  }
+}
+
+static int MapAdvice(const DiskStorageAdvice advice)
+{
+  switch (advice) {
+  case ADVISE_RANDOM:
+    return MADV_RANDOM;
+  case ADVISE_SEQUENTIAL:
+    return MADV_SEQUENTIAL;
+  case ADVISE_WILLNEED:
+    return MADV_WILLNEED;
+  case ADVISE_DONTNEED:
+    return MADV_DONTNEED;
+  default:
+    return MADV_NORMAL;
+  }
+}
+
+
+ERROR_T DiskStorage::SubmitRead(const SIZE_T off, BYTE_T *buf, const SIZE_T len, const SIZE_T tag)
+{
+  StorageCompletion c;
+  SIZE_T n=Read(off,buf,len,false);
+
+  // the rest is past the end of the file
+  memset(buf+n,0,len-n);
+  c.tag=tag;
+  c.rc=ERROR_NOERROR;
+  finished.push_back(c);
+  return ERROR_NOERROR;
+}
+
+ERROR_T DiskStorage::SubmitWrite(const SIZE_T off, const BYTE_T *buf, const SIZE_T len, const SIZE_T tag)
+{
+  StorageCompletion c;
+
+  c.tag=tag;
+  c.rc = Write(off,buf,len)==len ? ERROR_NOERROR : ERROR_IMPLBUG;
+  finished.push_back(c);
+  return ERROR_NOERROR;
+}
+
+ERROR_T DiskStorage::Poll(vector<StorageCompletion> &done, const SIZE_T min)
+{
+  done.insert(done.end(),finished.begin(),finished.end());
+  finished.clear();
+  return ERROR_NOERROR;
+}
+
+
+//
+// The original backend: a seek and a buffered read or write through
+// stdio for each request
+//
+class StdioStorage : public DiskStorage {
+ private:
+  FILE *f;
+
+  SIZE_T ReadAt(const SIZE_T off, BYTE_T *buf, const SIZE_T len, const bool trunconeof);
+
+ public:
+  StdioStorage() : f(0) {}
+  ~StdioStorage() { Close(); }
+
+  ERROR_T Open(const string &name, const bool create);
+  void    Close();
+  SIZE_T  Read(const SIZE_T off, BYTE_T *buf, const SIZE_T len, const bool extend)
+  { return ReadAt(off,buf,len,extend); }
+  SIZE_T  Write(const SIZE_T off, const BYTE_T *buf, const SIZE_T len);
+  void    Advise(const DiskStorageAdvice advice)
+  { posix_fadvise(fileno(f),0,0,FileAdvice(advice)); }
+  ERROR_T Sync() { return fflush(f) || fsync(fileno(f)) ? ERROR_IMPLBUG : ERROR_NOERROR; }
+
+  const char *GetName() const { return "stdio"; }
+};
+
+
+ERROR_T StdioStorage::Open(const string &name, const bool create)
+{
+  Close();
+  if ((f = fopen(name.c_str(),create ? "w+" : "r+"))==0) {
+    return ERROR_NOFILE;
+  }
+  return ERROR_NOERROR;
+}
+
+void StdioStorage::Close()
+{
+  if (f) {
+    fclose(f);
+    f=0;
+  }
+}
+
+SIZE_T StdioStorage::Write(const SIZE_T off, const BYTE_T *buf, const SIZE_T len)
+{
+  SIZE_T left=len;
+  SIZE_T sent;
+
+  fseek(f,off,SEEK_SET);
+  while (left>0) {
+    sent=fwrite(&(buf[len-left]),1,left,f);
+    if (sent==0) {
+      break;
+    } else {
+      left-=sent;
+    }
+  }
+  return len-left;
+}
+
+SIZE_T StdioStorage::ReadAt(const SIZE_T off, BYTE_T *buf, const SIZE_T len, const bool trunconeof)
+{
+  SIZE_T left=len;
+  SIZE_T sent;
+
+  fseek(f,off,SEEK_SET);
+  while (left>0) {
+    sent=fread(&(buf[len-left]),1,left,f);
+    if (sent==0) {
+      // if we reached this point, the likely cause is that we
+      // are trying to read a block which has not been allocated yet
+      // Hence, we will try to ftruncate to this size and then retry the
+      // read.  However, we don't want to loop forever doing this,
+      // hence the trunconeof parameter
+      if (!feof(f) || !trunconeof) {
+	break;
+      }
+      fflush(f);
+      if (ftruncate(fileno(f),off+len)) {
+	// uh oh, something weird is going on
+	break;
+      }
+      // OK, now retry, but don't truncate a second time
+      return ReadAt(off,buf,len,false);
+    } else {
+      left-=sent;
+    }
+  }
+  return len-left;
+}
+
+
+//
+// Positional reads and writes on a descriptor: no stdio buffer to
+// copy through, and no seek, so concurrent requests do not disturb
+// each other
+//
+class PreadStorage : public DiskStorage {
+ protected:
+  int  fd;
+  bool direct;
+
+ public:
+  PreadStorage() : fd(-1), direct(false) {}
+  ~PreadStorage() { Close(); }
+
+  ERROR_T Open(const string &name, const bool create);
+  void    Close();
+  SIZE_T  Read(const SIZE_T off, BYTE_T *buf, const SIZE_T len, const bool extend);
+  SIZE_T  Write(const SIZE_T off, const BYTE_T *buf, const SIZE_T len);
+  void    Advise(const DiskStorageAdvice advice) { posix_fadvise(fd,0,0,FileAdvice(advice)); }
+  ERROR_T Sync() { return fsync(fd) ? ERROR_IMPLBUG : ERROR_NOERROR; }
+  ERROR_T SetDirect(const bool d) { direct=d; return ERROR_NOERROR; }
+
+  const char *GetName() const { return "pread"; }
+};
+
+
+ERROR_T PreadStorage::Open(const string &name, const bool create)
+{
+  int flags = create ? O_RDWR|O_CREAT|O_TRUNC : O_RDWR;
+
+  Close();
+  if (direct) {
+    flags|=O_DIRECT;
+  }
+  if ((fd = open(name.c_str(),flags,0666))<0) {
+    return ERROR_NOFILE;
+  }
+  return ERROR_NOERROR;
+}
+
+void PreadStorage::Close()
+{
+  if (fd>=0) {
+    close(fd);
+    fd=-1;
+  }
+}
+
+SIZE_T PreadStorage::Write(const SIZE_T off, const BYTE_T *buf, const SIZE_T len)
+{
+  SIZE_T done=0;
+
+  while (done<len) {
+    ssize_t sent=pwrite(fd,buf+done,len-done,(off_t)off+done);
+    if (sent<0 && errno==EINTR) {
+      continue;
+    }
+    if (sent<=0) {
+      break;
+    }
+    done+=sent;
+  }
+  return done;
+}
+
+SIZE_T PreadStorage::Read(const SIZE_T off, BYTE_T *buf, const SIZE_T len, const bool extend)
+{
+  SIZE_T done=0;
+
+  while (done<len) {
+    ssize_t got=pread(fd,buf+done,len-done,(off_t)off+done);
+    if (got<0 && errno==EINTR) {
+      continue;
+    }
+    if (got<0) {
+      break;
+    }
+    if (got==0) {
+      // end of file: the rest was never written, so it reads as
+      // zeros once the file covers it
+      if (!extend || ftruncate(fd,(off_t)off+len)) {
+	break;
+      }
+      memset(buf+done,0,len-done);
+      done=len;
+      break;
+    }
+    done+=got;
+  }
+  return done;
+}
+
+
+//
+// Copies to and from a shared mapping of the whole file, so that a
+// block in the page cache costs one memcpy and no system call.  The
+// mapping grows, and the file with it, when a write or an extending
+// read goes past its end.  Writes reach the file when the OS writes
+// back the pages, or at Sync, unless writethrough is set, in which
+// case the pages of each write are synced before it returns.
+//
+class MmapStorage : public DiskStorage {
+ private:
+  int     fd;
+  BYTE_T *map;
+  SIZE_T  maplen;
+  bool    writethrough;
+  int     advice;
+
+  bool Grow(const SIZE_T len);
+
+ public:
+  MmapStorage(const bool writethrough) :
+    fd(-1), map(0), maplen(0), writethrough(writethrough), advice(MADV_NORMAL) {}
+  ~MmapStorage() { Close(); }
+
+  ERROR_T Open(const string &name, const bool create);
+  void    Close();
+  SIZE_T  Read(const SIZE_T off, BYTE_T *buf, const SIZE_T len, const bool extend);
+  SIZE_T  Write(const SIZE_T off, const BYTE_T *buf, const SIZE_T len);
+  void    Advise(const DiskStorageAdvice advice);
+  ERROR_T Sync();
+
+  const char *GetName() const { return writethrough ? "mmap-sync" : "mmap"; }
+};
+
+
+ERROR_T MmapStorage::Open(const string &name, const bool create)
+{
+  struct stat st;
+
+  Close();
+  if ((fd = open(name.c_str(),create ? O_RDWR|O_CREAT|O_TRUNC : O_RDWR,0666))<0) {
+    return ERROR_NOFILE;
+  }
+  if (fstat(fd,&st) || ((SIZE_T)st.st_size>0 && !Grow(st.st_size))) {
+    Close();
+    return ERROR_NOFILE;
+  }
+  return ERROR_NOERROR;
+}
+
+void MmapStorage::Close()
+{
+  if (map) {
+    munmap(map,maplen);
+    map=0;
+    maplen=0;
+  }
+  if (fd>=0) {
+    close(fd);
+    fd=-1;
+  }
+}
+
+// Maps at least the first len bytes, extending the file if it is
+// shorter
+bool MmapStorage::Grow(const SIZE_T len)
+{
+  struct stat st;
+  void *m;
+
+  if (len<=maplen) {
+    return true;
+  }
+  if (fstat(fd,&st) || ((SIZE_T)st.st_size<len && ftruncate(fd,len))) {
+    return false;
+  }
+  if (map) {
+    m=mremap(map,maplen,len,MREMAP_MAYMOVE);
+  } else {
+    m=mmap(0,len,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+  }
+  if (m==MAP_FAILED) {
+    return false;
+  }
+  map=(BYTE_T *)m;
+  maplen=len;
+  madvise(map,maplen,advice);
+  return true;
+}
+
+SIZE_T MmapStorage::Read(const SIZE_T off, BYTE_T *buf, const SIZE_T len, const bool extend)
+{
+  if (off+len>maplen) {
+    struct stat st;
+    // the file may be longer than the mapping, and the rest of it
+    // is mapped before giving up on it
+    if (fstat(fd,&st)) {
+      return 0;
+    }
+    SIZE_T size=st.st_size;
+    if (extend && size<off+len) {
+      size=off+len;
+    }
+    if (size>maplen && !Grow(size)) {
+      return 0;
+    }
+  }
+  if (off>=maplen) {
+    return 0;
+  }
+
+  SIZE_T n = off+len<=maplen ? len : maplen-off;
+  memcpy(buf,map+off,n);
+  return n;
+}
+
+SIZE_T MmapStorage::Write(const SIZE_T off, const BYTE_T *buf, const SIZE_T len)
+{
+  if (!Grow(off+len)) {
+    return 0;
+  }
+  memcpy(map+off,buf,len);
+  if (writethrough) {
+    // msync wants a page aligned start
+    SIZE_T start=off-off%sysconf(_SC_PAGESIZE);
+    if (msync(map+start,off+len-start,MS_SYNC)) {
+      return 0;
+    }
+  }
+  return len;
+}
+
+void MmapStorage::Advise(const DiskStorageAdvice a)
+{
+  if (a==ADVISE_DONTNEED) {
+    // once, not for the pages mapped later
+    if (map) {
+      madvise(map,maplen,MADV_DONTNEED);
+    }
+    return;
+  }
+  advice=MapAdvice(a);
+  if (map) {
+    madvise(map,maplen,advice);
+  }
+}
+
+ERROR_T MmapStorage::Sync()
+{
+  if (map && msync(map,maplen,MS_SYNC)) {
+    return ERROR_IMPLBUG;
+  }
+  return ERROR_NOERROR;
+}
+
+
+//
+// pread and pwrite for synchronous requests, and an io_uring ring of
+// queuedepth entries for asynchronous ones, driven through the raw
+// system calls.  Each request has a slot, found again through the
+// user_data of its completion, which keeps what is left of it, so
+// that a short transfer is sent again for the rest.  A submit with
+// every slot busy first waits for one to finish.  Once the kernel
+// refuses an entry, the ring is broken: the entry may still be on
+// it, naming its slot, so no more are submitted.
+//
+// How long Close watches a broken ring for what is still in flight
+const SIZE_T URING_CLOSE_WAIT_MS=1000;
+
+struct UringRequest {
+  bool    busy;
+  bool    write;
+  SIZE_T  tag;
+  SIZE_T  off;
+  BYTE_T *buf;
+  SIZE_T  len;
+  SIZE_T  done;
+};
+
+class UringStorage : public PreadStorage {
+ private:
+  SIZE_T    queuedepth;
+  int       ringfd;
+  BYTE_T   *sqring;
+  BYTE_T   *cqring;
+  size_t    sqringsize;
+  size_t    cqringsize;
+  struct io_uring_sqe *sqes;
+  size_t    sqessize;
+  unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+  unsigned *cqhead, *cqtail, *cqmask;
+  struct io_uring_cqe *cqes;
+  vector<UringRequest> reqs;
+  SIZE_T    outstanding;
+  bool      broken;
+
+  bool    SetupRing();
+  void    TeardownRing();
+  ERROR_T Queue(const SIZE_T slot);
+  ERROR_T Submit(const bool write, const SIZE_T off, BYTE_T *buf, const SIZE_T len, const SIZE_T tag);
+  SIZE_T  Collect();
+  ERROR_T Reap(const SIZE_T min);
+
+ public:
+  UringStorage(const SIZE_T queuedepth);
+  ~UringStorage() { Close(); }
+
+  ERROR_T Open(const string &name, const bool create);
+  void    Close();
+  ERROR_T SubmitRead(const SIZE_T off, BYTE_T *buf, const SIZE_T len, const SIZE_T tag)
+  { return Submit(false,off,buf,len,tag); }
+  ERROR_T SubmitWrite(const SIZE_T off, const BYTE_T *buf, const SIZE_T len, const SIZE_T tag)
+  { return Submit(true,off,(BYTE_T *)buf,len,tag); }
+  ERROR_T Poll(vector<StorageCompletion> &done, const SIZE_T min);
+  SIZE_T  GetNumOutstanding() const { return outstanding+finished.size(); }
+
+  const char *GetName() const { return "uring"; }
+};
+
+
+UringStorage::UringStorage(const SIZE_T qd) :
+  queuedepth(qd>0 ? qd : 1), ringfd(-1), sqring(0), cqring(0), sqes(0), outstanding(0),
+  broken(false)
+{}
+
+ERROR_T UringStorage::Open(const string &name, const bool create)
+{
+  ERROR_T rc;
+
+  Close();
+  if ((rc=PreadStorage::Open(name,create))!=ERROR_NOERROR) {
+    return rc;
+  }
+  // without a ring, requests are done as they are submitted
+  SetupRing();
+  return ERROR_NOERROR;
+}
+
+void UringStorage::Close()
+{
+  if (ringfd>=0 && (broken || Reap(outstanding)!=ERROR_NOERROR)) {
+    // The kernel cannot be waited on, but may still be using the
+    // buffers of what is in flight.  Their completions still reach
+    // the ring, so watch it for a while before closing it, which
+    // cancels whatever is left.
+    for (SIZE_T ms=0;outstanding>0 && ms<URING_CLOSE_WAIT_MS;ms++) {
+      usleep(1000);
+      Collect();
+    }
+  }
+  finished.clear();
+  TeardownRing();
+  PreadStorage::Close();
+}
+
+bool UringStorage::SetupRing()
+{
+  struct io_uring_params p;
+
+  memset(&p,0,sizeof(p));
+  if ((ringfd=syscall(__NR_io_uring_setup,queuedepth,&p))<0) {
+    return false;
+  }
+
+  sqringsize=p.sq_off.array+p.sq_entries*sizeof(unsigned);
+  cqringsize=p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    sqringsize=cqringsize=(sqringsize>cqringsize ? sqringsize : cqringsize);
+  }
+  sqring=(BYTE_T *)mmap(0,sqringsize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+			ringfd,IORING_OFF_SQ_RING);
+  if (sqring==MAP_FAILED) {
+    sqring=0;
+    TeardownRing();
+    return false;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    cqring=sqring;
+  } else {
+    cqring=(BYTE_T *)mmap(0,cqringsize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+			  ringfd,IORING_OFF_CQ_RING);
+    if (cqring==MAP_FAILED) {
+      cqring=0;
+      TeardownRing();
+      return false;
+    }
+  }
+  sqessize=p.sq_entries*sizeof(struct io_uring_sqe);
+  sqes=(struct io_uring_sqe *)mmap(0,sqessize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+				   ringfd,IORING_OFF_SQES);
+  if (sqes==MAP_FAILED) {
+    sqes=0;
+    TeardownRing();
+    return false;
+  }
+
+  sqhead=(unsigned *)(sqring+p.sq_off.head);
+  sqtail=(unsigned *)(sqring+p.sq_off.tail);
+  sqmask=(unsigned *)(sqring+p.sq_off.ring_mask);
+  sqarray=(unsigned *)(sqring+p.sq_off.array);
+  cqhead=(unsigned *)(cqring+p.cq_off.head);
+  cqtail=(unsigned *)(cqring+p.cq_off.tail);
+  cqmask=(unsigned *)(cqring+p.cq_off.ring_mask);
+  cqes=(struct io_uring_cqe *)(cqring+p.cq_off.cqes);
+
+  // the kernel may round the depth up
+  reqs.assign(p.sq_entries<queuedepth ? p.sq_entries : queuedepth,UringRequest());
+  for (SIZE_T i=0;i<reqs.size();i++) {
+    reqs[i].busy=false;
+  }
+  return true;
+}
+
+void UringStorage::TeardownRing()
+{
+  if (sqes) {
+    munmap(sqes,sqessize);
+    sqes=0;
+  }
+  if (cqring && cqring!=sqring) {
+    munmap(cqring,cqringsize);
+  }
+  cqring=0;
+  if (sqring) {
+    munmap(sqring,sqringsize);
+    sqring=0;
+  }
+  if (ringfd>=0) {
+    close(ringfd);
+    ringfd=-1;
+  }
+  reqs.clear();
+  outstanding=0;
+  broken=false;
+}
+
+// Puts what is left of a slot's request on the ring and submits it
+ERROR_T UringStorage::Queue(const SIZE_T slot)
+{
+  UringRequest &r=reqs[slot];
+  unsigned tail=*sqtail;
+  unsigned idx=tail & *sqmask;
+  struct io_uring_sqe *sqe=&sqes[idx];
+
+  memset(sqe,0,sizeof(*sqe));
+  sqe->opcode = r.write ? IORING_OP_WRITE : IORING_OP_READ;
+  sqe->fd=fd;
+  sqe->addr=(unsigned long)(r.buf+r.done);
+  sqe->len=r.len-r.done;
+  sqe->off=(off_t)r.off+r.done;
+  sqe->user_data=slot;
+  sqarray[idx]=idx;
+  __atomic_store_n(sqtail,tail+1,__ATOMIC_RELEASE);
+
+  while (syscall(__NR_io_uring_enter,ringfd,1,0,0,0,0)<0) {
+    if (errno!=EINTR && errno!=EAGAIN) {
+      broken=true;
+      return ERROR_IMPLBUG;
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T UringStorage::Submit(const bool write, const SIZE_T off, BYTE_T *buf, const SIZE_T len,
+			     const SIZE_T tag)
+{
+  SIZE_T slot;
+  ERROR_T rc;
+
+  if (ringfd<0) {
+    return write ? DiskStorage::SubmitWrite(off,buf,len,tag) : DiskStorage::SubmitRead(off,buf,len,tag);
+  }
+  if (broken) {
+    return ERROR_IMPLBUG;
+  }
+  if (outstanding==reqs.size() && (rc=Reap(1))!=ERROR_NOERROR) {
+    // no slot came free
+    return rc;
+  }
+  for (slot=0;reqs[slot].busy;slot++) {
+  }
+
+  UringRequest &r=reqs[slot];
+  r.busy=true;
+  r.write=write;
+  r.tag=tag;
+  r.off=off;
+  r.buf=buf;
+  r.len=len;
+  r.done=0;
+  if ((rc=Queue(slot))!=ERROR_NOERROR) {
+    r.busy=false;
+    return rc;
+  }
+  outstanding++;
+  return ERROR_NOERROR;
+}
+
+// Moves the completions already on the ring to finished, and
+// returns how many requests that finished
+SIZE_T UringStorage::Collect()
+{
+  SIZE_T got=0;
+  unsigned head=*cqhead;
+  unsigned tail=__atomic_load_n(cqtail,__ATOMIC_ACQUIRE);
+
+  while (head!=tail) {
+    struct io_uring_cqe *cqe=&cqes[head & *cqmask];
+    SIZE_T slot=cqe->user_data;
+    int res=cqe->res;
+    UringRequest &r=reqs[slot];
+    bool again=false;
+    ERROR_T rc=ERROR_NOERROR;
+
+    head++;
+    __atomic_store_n(cqhead,head,__ATOMIC_RELEASE);
+
+    if (!r.busy) {
+      // an entry the kernel refused, which already failed
+      continue;
+    }
+    if (res==-EINTR || res==-EAGAIN) {
+      again=true;
+    } else if (res<0) {
+      rc=ERROR_IMPLBUG;
+    } else if (res==0) {
+      if (r.write) {
+	rc=ERROR_IMPLBUG;
+      } else {
+	// end of file
+	memset(r.buf+r.done,0,r.len-r.done);
+      }
+    } else {
+      r.done+=res;
+      again = r.done<r.len;
+    }
+    if (again && Queue(slot)==ERROR_NOERROR) {
+      continue;
+    }
+    if (again) {
+      rc=ERROR_IMPLBUG;
+    }
+
+    StorageCompletion c;
+    c.tag=r.tag;
+    c.rc=rc;
+    finished.push_back(c);
+    r.busy=false;
+    outstanding--;
+    got++;
+  }
+  return got;
+}
+
+// Moves completions to finished, waiting for at least min of them
+// returns ERROR_NOERROR, or ERROR_IMPLBUG if the kernel would not
+// let it wait, which leaves the ring broken
+ERROR_T UringStorage::Reap(const SIZE_T min)
+{
+  SIZE_T got=0;
+
+  while (outstanding>0) {
+    got+=Collect();
+    if (got>=min || outstanding==0) {
+      break;
+    }
+    if (syscall(__NR_io_uring_enter,ringfd,0,1,IORING_ENTER_GETEVENTS,0,0)<0 &&
+	errno!=EINTR) {
+      broken=true;
+      return ERROR_IMPLBUG;
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T UringStorage::Poll(vector<StorageCompletion> &done, const SIZE_T min)
+{
+  ERROR_T rc=ERROR_NOERROR;
+
+  if (ringfd>=0) {
+    rc=Reap(min>finished.size() ? min-finished.size() : 0);
+  }
+  DiskStorage::Poll(done,min);
+  return rc;
+}
+
+
+
+DiskStorage *MakeDiskStorage(const DiskStorageType type, const SIZE_T queuedepth)
+{
+  switch (type) {
+  case STORAGE_PREAD:
+    return new PreadStorage();
+  case STORAGE_STDIO:
+    return new StdioStorage();
+  case STORAGE_MMAP:
+    return new MmapStorage(false);
+  case STORAGE_MMAP_SYNC:
+    return new MmapStorage(true);
+  case STORAGE_URING:
+    return new UringStorage(queuedepth);
+  default:
+    return 0;
+  }
+}
+
+
+ERROR_T ParseDiskStorage(const char *name, DiskStorageType &type)
+{
+  if (!strcasecmp(name,"pread")) {
+    type=STORAGE_PREAD;
+  } else if (!strcasecmp(name,"stdio")) {
+    type=STORAGE_STDIO;
+  } else if (!strcasecmp(name,"mmap")) {
+    type=STORAGE_MMAP;
+  } else if (!strcasecmp(name,"mmap-sync")) {
+    type=STORAGE_MMAP_SYNC;
+  } else if (!strcasecmp(name,"uring")) {
+    type=STORAGE_URING;
+  } else {
+    return ERROR_BADCONFIG;
+  }
+  return ERROR_NOERROR;
+}
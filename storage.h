@@ -0,0 +1,98 @@
+#ifndef _storage
+#define _storage
+
+#include <string>
+#include <vector>
+
+#include "global.h"
+
+using namespace std;
+
+
+enum DiskStorageType {STORAGE_PREAD, STORAGE_STDIO, STORAGE_MMAP, STORAGE_MMAP_SYNC, STORAGE_URING};
+
+// How the file is about to be used, for read-ahead by the OS.
+// DONTNEED drops what the OS has cached of it.
+enum DiskStorageAdvice {ADVISE_NORMAL, ADVISE_RANDOM, ADVISE_SEQUENTIAL, ADVISE_WILLNEED,
+			ADVISE_DONTNEED};
+
+
+// Requests a backend may have in flight, unless told otherwise
+const SIZE_T STORAGE_QUEUE_DEPTH=32;
+
+struct StorageCompletion {
+  SIZE_T  tag;
+  ERROR_T rc;
+};
+
+
+//
+// Where a DiskSystem keeps its data file.  Offsets are in bytes from
+// the start of the file.  Neither call moves a shared file position,
+// so a backend that can do so, as pread does, lets more than one
+// request be in flight at once.  The simulated time of a request
+// comes from the DiskSystem's model, not from here.
+//
+class DiskStorage {
+ protected:
+  // requests carried out at Submit and not yet polled
+  vector<StorageCompletion> finished;
+
+ public:
+  virtual ~DiskStorage() {}
+
+  // Opens an existing file, or with create set, makes an empty one
+  // returns ERROR_NOERROR or ERROR_NOFILE
+  virtual ERROR_T Open(const string &name, const bool create)=0;
+  // Direct I/O, past the OS's cache, for files opened after this.
+  // Offsets, lengths and buffers must then meet the file system's
+  // alignment.  Only the descriptor based backends, pread and
+  // uring, have it.
+  // returns ERROR_NOERROR or ERROR_UNIMPL
+  virtual ERROR_T SetDirect(const bool direct) { return direct ? ERROR_UNIMPL : ERROR_NOERROR; }
+  virtual void    Close()=0;
+
+  // Each returns the number of bytes moved.  A read that runs off
+  // the end of the file, with extend set, grows the file to cover
+  // the request and reads zeros there, as for blocks never written.
+  virtual SIZE_T  Read(const SIZE_T off, BYTE_T *buf, const SIZE_T len, const bool extend)=0;
+  virtual SIZE_T  Write(const SIZE_T off, const BYTE_T *buf, const SIZE_T len)=0;
+
+  // Passes the advice on to the OS, if the backend can
+  virtual void    Advise(const DiskStorageAdvice advice) {}
+  // Forces what has been written out to the file
+  // returns ERROR_NOERROR or ERROR_IMPLBUG
+  virtual ERROR_T Sync() { return ERROR_NOERROR; }
+
+  // Asynchronous requests.  The buffer must stay until Poll has
+  // handed back the tag, which the storage does not look at.  Reads
+  // past the end of the file read as zeros, without growing it.  A
+  // request may have been carried out by the time Submit returns,
+  // as it always is unless the backend can queue them.
+  // returns ERROR_NOERROR, or an error if it could not be queued
+  virtual ERROR_T SubmitRead(const SIZE_T off, BYTE_T *buf, const SIZE_T len, const SIZE_T tag);
+  virtual ERROR_T SubmitWrite(const SIZE_T off, const BYTE_T *buf, const SIZE_T len, const SIZE_T tag);
+  // Moves finished requests to done, first waiting until at least
+  // min have finished or none are outstanding.  If the wait itself
+  // fails, what has finished is still moved.
+  // returns ERROR_NOERROR or ERROR_IMPLBUG
+  virtual ERROR_T Poll(vector<StorageCompletion> &done, const SIZE_T min);
+  virtual SIZE_T  GetNumOutstanding() const { return finished.size(); }
+
+  virtual const char *GetName() const=0;
+};
+
+
+// returns zero for an unknown type
+// queuedepth is the most requests in flight for the uring backend,
+// which falls back to doing them one at a time if the kernel does
+// not let it have a ring
+DiskStorage *MakeDiskStorage(const DiskStorageType type,
+			     const SIZE_T queuedepth=STORAGE_QUEUE_DEPTH);
+
+// accepts pread, stdio, mmap, mmap-sync, or uring
+// returns ERROR_NOERROR or ERROR_BADCONFIG
+ERROR_T ParseDiskStorage(const char *name, DiskStorageType &type);
+
+
+#endif